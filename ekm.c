@@ -33,117 +33,364 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/event.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <sys/queue.h>
 
 #include <errno.h>
 #include <fcntl.h>
-#include <netdb.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <syslog.h>
 #include <time.h>
-#include <termios.h>
 #include <unistd.h>
 
 #include "ekm.h"
+#include "ekmd.h"
 
 #undef ISERIAL
 
-int
-main(int argc, char **argv)
-{
-	FILE			*fp = NULL;
 #ifdef ISERIAL
-	struct sockaddr_in	 server;
-	struct protoent		*prot;
-	char			*address = "192.168.88.17";
+#define	EKM_BUS		"192.168.88.17:50000"
 #else
-	struct termios		 old_tios, tios;
+#define	EKM_BUS		"/dev/cuaU0"
 #endif
+
+#define	NUM_EVENTS	64
+
+static char	 outbuf[16384];
+static size_t	 outlen;
+static int	 logfd = -1;
+
+/*
+ * Readings are collected in outbuf and handed to the write-ahead log as
+ * one record at the end of each polling cycle.
+ */
+static void
+out_flush(void)
+{
+	wal_append(outbuf, outlen);
+	outlen = 0;
+}
+
+static void
+out_printf(const char *fmt, ...)
+{
+	va_list	 ap;
+	int	 len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(outbuf + outlen, sizeof(outbuf) - outlen, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (outlen + len >= sizeof(outbuf)) {
+		out_flush();
+		va_start(ap, fmt);
+		len = vsnprintf(outbuf, sizeof(outbuf), fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if (len >= sizeof(outbuf))
+			len = sizeof(outbuf) - 1;
+	}
+	outlen += len;
+}
+
+/*
+ * The log stays open between cycles.  If whoever collects it renames or
+ * removes it, kqueue tells us and we start a new one.
+ */
+static int
+log_open(int eventq, const char *path)
+{
+	struct kevent	 event;
+	int		 fd;
+
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1) {
+		syslog(LOG_ERR, "Can't open %s: %m", path);
+		/* Stop writing to the old log; the next tick tries again. */
+		if (logfd != -1) {
+			wal_setlog(-1);
+			close(logfd);
+			logfd = -1;
+		}
+		return(-1);
+	}
+	wal_setlog(fd);
+	if (logfd != -1)
+		close(logfd);
+	logfd = fd;
+	EV_SET(&event, logfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+	    NOTE_DELETE | NOTE_RENAME, 0, NULL);
+	kevent(eventq, &event, 1, NULL, 0, NULL);
+
+	return(logfd);
+}
+
+static void
+log_schedule(struct meter_schedule *sched)
+{
+	int	 i, j;
+
+	for (i = 0; i < EKM_SCHEDULES; i++) {
+		out_printf("Schedule %d:", i + 1);
+		for (j = 0; j < EKM_PERIODS; j++)
+			out_printf(" %02d:%02d %d", sched->schedule[i][j].hour,
+			    sched->schedule[i][j].min,
+			    sched->schedule[i][j].rate);
+		out_printf("\n");
+	}
+	out_printf("Seasons:");
+	for (i = 0; i < EKM_SEASONS; i++)
+		out_printf(" %02d-%02d %d", sched->season[i].month,
+		    sched->season[i].day, sched->season[i].schedule);
+	out_printf("\nHolidays:");
+	for (i = 0; i < EKM_HOLIDAYS; i++)
+		if (sched->holiday[i].month != 0)
+			out_printf(" %02d-%02d", sched->holiday[i].month,
+			    sched->holiday[i].day);
+	out_printf("\nWeekend schedule: %d\nHoliday schedule: %d\n",
+	    sched->weekend_schedule, sched->holiday_schedule);
+}
+
+static void
+log_history(struct meter_response *reply, struct meter_history *history)
+{
+	struct meter_tou	*a, *b;
+	int			 i;
+
+	a = &reply->forward;
+	b = &history->forward[0];
+	out_printf("Current fwd:    "
+	    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
+	    a->total - b->total, a->tou[0] - b->tou[0],
+	    a->tou[1] - b->tou[1], a->tou[2] - b->tou[2],
+	    a->tou[3] - b->tou[3]);
+	a = &reply->reverse;
+	b = &history->reverse[0];
+	out_printf("Current rev:    "
+	    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
+	    a->total - b->total, a->tou[0] - b->tou[0],
+	    a->tou[1] - b->tou[1], a->tou[2] - b->tou[2],
+	    a->tou[3] - b->tou[3]);
+	for (i = 0; i < 5; i++) {
+		a = &reply->forward;
+		b = &history->forward[i];
+		out_printf("History fwd -%d: "
+		    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
+		    i+1, a->total - b->total,
+		    a->tou[0]-b->tou[0], a->tou[1]-b->tou[1],
+		    a->tou[2]-b->tou[2], a->tou[3]-b->tou[3]);
+		a = &reply->reverse;
+		b = &history->reverse[i];
+		out_printf("History rev -%d: "
+		    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
+		    i+1, a->total - b->total,
+		    a->tou[0]-b->tou[0], a->tou[1]-b->tou[1],
+		    a->tou[2]-b->tou[2], a->tou[3]-b->tou[3]);
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: ekm [-b bus] [-c commit-ms] [-w workdir] "
+	    "[-d first-last [bus ...]]\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
 	struct meter_response	 reply;
 	struct meter_history 	 history;
 	struct meter_schedule	 schedule;
-	struct meter_tou	*a, *b;
 	struct timespec		 ts;
-	struct kevent		 event, evlist;
+	struct kevent		 event, evlist[NUM_EVENTS];
 	struct stat		 sb;
-	#define	NUM_METERS	1
-	u_int64_t		 meter[NUM_METERS] = { 13491 };
+	struct meter		*m;
+	struct ctl_request	*req, *next;
 	time_t			 clock;
+	char			*bus = EKM_BUS;
 	char			*password = "00000000";
 	char			*workdir = "/home/ianf/graphing/";
 	char			*log = "ekm-imhoff.pending";
-	char			 path[1024];
-	int			 con, i, j, eventq, result;
+	char			 logpath[1024], invpath[1024], path[1024];
+	int			 con, ctlfd, wdfd, i, j, k, eventq, nevents;
+	int			 result, scan, tick, ch, dflag;
+	u_int64_t		 first, last;
+
+	dflag = 0;
+	while ((ch = getopt(argc, argv, "b:c:d:w:")) != -1) {
+		switch (ch) {
+		    case 'b':
+			bus = optarg;
+			break;
+		    case 'c':
+			wal_interval = strtol(optarg, NULL, 10);
+			if (wal_interval < 0)
+				usage();
+			break;
+		    case 'd':
+			if (sscanf(optarg, "%llu-%llu", &first, &last) != 2 ||
+			    first > last)
+				usage();
+			dflag = 1;
+			break;
+		    case 'w':
+			/* Paths are built by appending to workdir. */
+			workdir = optarg;
+			if (*workdir == '\0' ||
+			    workdir[strlen(workdir) - 1] != '/')
+				usage();
+			break;
+		    default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	snprintf(invpath, sizeof(invpath), "%smeters", workdir);
+
+	/*
+	 * Discovery: sweep the buses given, or the default bus, for meters
+	 * and add them to the inventory.
+	 */
+	if (dflag) {
+		if (argc == 0) {
+			argc = 1;
+			argv = &bus;
+		}
+		result = discover(argv, argc, first, last, invpath);
+		exit(result < 0 ? EX_OSERR : EX_OK);
+	}
 
 	openlog("ekmreader", LOG_PID | LOG_CONS, LOG_DAEMON);
+	/* Control clients and TCP buses can go away mid-write. */
+	signal(SIGPIPE, SIG_IGN);
 
-#ifdef ISERIAL
-	prot = getprotobyname("TCP");
-	con = socket(AF_INET, SOCK_STREAM, prot->p_proto);
-	server.sin_family = AF_INET;
-	inet_aton(address, &server.sin_addr);
-	server.sin_port = htons(50000);
-
-	if (connect(con, (struct sockaddr *)&server, sizeof(server))) {
-		printf("Connection failed\n");
+	if ((con = ekm_connect(bus)) == -1) {
+		printf("Connection to %s failed\n", bus);
 		exit(EX_OSERR);
 	}
-#else
-	con = open("/dev/cuaU0", O_RDWR | O_NOCTTY | O_EXCL);
-	tcgetattr(con, &old_tios);
-	memset(&tios, '\0', sizeof(struct termios));
-	cfsetispeed(&tios, B9600);
-	cfsetospeed(&tios, B9600);
-	tios.c_cflag |= (CREAD | CLOCAL);
-	tios.c_cflag &= ~CSIZE;
-	tios.c_cflag |= CS7;	/* 7 Bits */
-	tios.c_cflag &= ~CSTOPB; /* 1 Stop Bit */
-	tios.c_cflag |= PARENB; /* Even Parity */
-	tios.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-	tios.c_iflag &= INPCK | ISTRIP;
-	tios.c_iflag &= ~(IXON | IXOFF | IXANY);
-	tios.c_oflag &= ~OPOST;	/* Raw ouput */
-	tios.c_cc[VMIN] = 1;
-	tios.c_cc[VTIME] = 1;
-	if (tcsetattr(con, TCSANOW, &tios) < 0) {
-		perror("tcsetattr\n");
-		exit(-1);
-	}
-#endif
-
-	fcntl(con, F_SETFL, O_NONBLOCK);
 	ekm_flush(con);
 
+	snprintf(logpath, sizeof(logpath), "%s%s", workdir, log);
+	if (inventory_load(invpath) <= 0 && meter_add(13491) == NULL) {
+		syslog(LOG_ERR, "No meters");
+		exit(EX_CONFIG);
+	}
+
 	eventq = kqueue();
 	EV_SET(&event, 1, EVFILT_TIMER, EV_ADD|EV_ENABLE, 0, 1000, NULL);
 	ts.tv_sec=0;
 	ts.tv_nsec=0;
-	kevent(eventq, &event, 1, &evlist, 1, &ts);
-
-	for(;kevent(eventq, NULL, 0, &evlist, 1, NULL) != -1;) {
-	 	if (evlist.data > 1)
-			syslog(LOG_NOTICE, "Missed %d events", evlist.data - 1);
-		strcpy(path, workdir);
-		strcat(path, log);
-		if ((fp = fopen(path, "a")) == NULL)
+	kevent(eventq, &event, 1, evlist, 1, &ts);
+	snprintf(path, sizeof(path), "%sekm.wal", workdir);
+	wal_open(path);
+	log_open(eventq, logpath);
+	/* Commit readings at least every wal_interval ms. */
+	if (wal_interval > 0) {
+		EV_SET(&event, 2, EVFILT_TIMER, EV_ADD|EV_ENABLE, 0,
+		    wal_interval, NULL);
+		kevent(eventq, &event, 1, NULL, 0, NULL);
+	}
+	snprintf(path, sizeof(path), "%sekm.sock", workdir);
+	ctlfd = ctl_listen(eventq, path, invpath);
+
+	/*
+	 * History can still be requested by creating readhistory.<serial>.
+	 * Rather than stat() every request file on every tick, only look for
+	 * them when something in the work directory changes.
+	 */
+	scan = 1;
+	if ((wdfd = open(workdir, O_RDONLY | O_DIRECTORY)) != -1) {
+		EV_SET(&event, wdfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+		    NOTE_WRITE, 0, NULL);
+		kevent(eventq, &event, 1, NULL, 0, NULL);
+	}
+
+	for (;;) {
+		nevents = kevent(eventq, NULL, 0, evlist, NUM_EVENTS, NULL);
+		if (nevents == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (tick = 0, k = 0; k < nevents; k++) {
+			switch (evlist[k].filter) {
+			    case EVFILT_TIMER:
+				if (evlist[k].ident == 2) {
+					wal_commit();
+					break;
+				}
+				if (evlist[k].data > 1)
+					syslog(LOG_NOTICE, "Missed %d events",
+					    evlist[k].data - 1);
+				tick = 1;
+				break;
+			    case EVFILT_READ:
+				if (evlist[k].ident == ctlfd)
+					ctl_accept(ctlfd);
+				else
+					ctl_input(evlist[k].udata);
+				break;
+			    case EVFILT_WRITE:
+				ctl_output(evlist[k].udata);
+				break;
+			    case EVFILT_VNODE:
+				if (evlist[k].ident == wdfd)
+					scan = 1;
+				else
+					log_open(eventq, logpath);
+				break;
+			}
+		}
+		ctl_reap();
+		if (!tick)
+			continue;
+		if (logfd == -1 && log_open(eventq, logpath) == -1)
 			continue;
-		for (j = 0; j < NUM_METERS; j++) {
+		if (scan) {
+			/*
+			 * Pick up meters added to the inventory, by discovery.
+			 * Meters already polled are skipped, so just reread it.
+			 */
+			inventory_load(invpath);
+			for (j = 0; j < nmeters; j++) {
+				m = meters[j];
+				if (m->marker)
+					continue;
+				snprintf(path, sizeof(path), "%sreadhistory.%llu",
+				    workdir, m->handle.address);
+				if (!stat(path, &sb)) {
+					m->marker = 1;
+					ctl_enqueue(m, CTL_HISTORY, NULL);
+				}
+			}
+			scan = (wdfd == -1);
+		}
+		for (j = 0; j < nmeters; j++) {
+		m = meters[j];
 		/* We record the system time after opening the meter so we have
 		 * the time as close to when the meter generates the response..
 		 */
-		result = meter_open(con, &reply, meter[j]);
+		result = meter_open_handle(con, &reply, &m->handle);
 		switch (result) {
 		    case 0:
-			syslog(LOG_NOTICE, "Bad CRC on meter %llu", meter[j]);
+			syslog(LOG_NOTICE, "Bad CRC on meter %llu",
+			    m->handle.address);
+			ctl_fail(m);
 			goto close;
 			break;
 		    case -1:
 			syslog(LOG_NOTICE, "Read timed out on meter %llu",
-			    meter[j]);
+			    m->handle.address);
+			ctl_fail(m);
 			goto close;
 			break;
 		    default:
@@ -157,85 +404,96 @@ main(int argc, char **argv)
 		 */
 		if (abs(clock - reply.time) >= 3) {
 			syslog(LOG_NOTICE, "Meter %llu clock drift "
-			    "too large %d\n", meter[j],
+			    "too large %d\n", m->handle.address,
 			    clock - reply.time);
 			/* Supply the password */
 			result = meter_login(con, password);
 			if (result < 0) {
 				syslog(LOG_NOTICE, "Read timed out on "
-				    "meter %llu", meter[j]);
+				    "meter %llu", m->handle.address);
 				goto close;
 			}
 			if (result != 1) {
 				syslog(LOG_NOTICE, "Wrong password for "
-				    "meter %llu", meter[j]);
+				    "meter %llu", m->handle.address);
 				goto close;
 			}
 			set_time(con);
 		}
 
-		fprintf(fp, "%d\n", clock);
-		fprintf(fp, "meter: %llu %d\n", meter[j], reply.firmware);
+		out_printf("%d\n", clock);
+		out_printf("meter: %llu %d\n", m->handle.address, reply.firmware);
 		for(i = 0; i <= 2; i++)
-	 		fprintf(fp, "L%d Volts: %-5.1lf\n", i+1, reply.volts[i]);
+	 		out_printf("L%d Volts: %-5.1lf\n", i+1, reply.volts[i]);
 
 		for(i = 0; i <= 2; i++)
-			fprintf(fp, "L%d Amps: %-6.1lf\n", i+1, reply.amps[i]);
+			out_printf("L%d Amps: %-6.1lf\n", i+1, reply.amps[i]);
 
 		for(i = 0; i <= 2; i++)
-			fprintf(fp, "L%d Power: %-8.1d\n", i+1, reply.power[i]);
+			out_printf("L%d Power: %-8.1d\n", i+1, reply.power[i]);
 
 		for(i = 0; i <= 2; i++)
-			fprintf(fp, "L%d PF: %4.2lf\n", i + 1, reply.pf[i]);
-		fprintf(fp, "CT Size: %d\n", reply.ct_size);
-
-		fprintf(fp, "Frw kWh: %-9.1lf\n", reply.forward.total);
-		fprintf(fp, "Rev kWh: %-9.1lf\n", reply.reverse.total);
-		fprintf(fp, "Demand: %-9llu\n", reply.max_demand);
-		fprintf(fp, "Demand Period: %c\n", reply.demand_period);
-
-		sprintf(path, "%sreadhistory.%llu", workdir, meter[j]);
-		if (!stat(path, &sb) && readhistory(con, &history)) {
-			a = &reply.forward;
-			b = &history.forward[0];
-			fprintf(fp, "Current fwd:    "
-			    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
-			    a->total - b->total, a->tou[0] - b->tou[0],
-			    a->tou[1] - b->tou[1], a->tou[2] - b->tou[2],
-			    a->tou[3] - b->tou[3]);
-			a = &reply.reverse;
-			b = &history.reverse[0];
-			fprintf(fp, "Current rev:    "
-			    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
-			    a->total - b->total, a->tou[0] - b->tou[0],
-			    a->tou[1] - b->tou[1], a->tou[2] - b->tou[2],
-			    a->tou[3] - b->tou[3]);
-			for (i = 0; i < 5; i++) {
-				a = &reply.forward;
-				b = &history.forward[i];
-				fprintf(fp, "History fwd -%d: "
-				    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
-				    i+1, a->total - b->total,
-				    a->tou[0]-b->tou[0], a->tou[1]-b->tou[1],
-				    a->tou[2]-b->tou[2], a->tou[3]-b->tou[3]);
-				a = &reply.reverse;
-				b = &history.reverse[i];
-				fprintf(fp, "History rev -%d: "
-				    "%-8.1lf %-8.1lf %-8.1lf %-8.1lf %-8.1lf\n",
-				    i+1, a->total - b->total,
-				    a->tou[0]-b->tou[0], a->tou[1]-b->tou[1],
-				    a->tou[2]-b->tou[2], a->tou[3]-b->tou[3]);
+			out_printf("L%d PF: %4.2lf\n", i + 1, reply.pf[i]);
+		out_printf("CT Size: %d\n", reply.ct_size);
+
+		out_printf("Frw kWh: %-9.1lf\n", reply.forward.total);
+		out_printf("Rev kWh: %-9.1lf\n", reply.reverse.total);
+		out_printf("Demand: %-9llu\n", reply.max_demand);
+		out_printf("Demand Period: %c\n", reply.demand_period);
+		if (m->have_schedule)
+			out_printf("Rate: %d\n",
+			    meter_tariff_rate_time(&m->tariff, reply.time));
+
+		/*
+		 * Carry out queued requests while the meter is open.  A failed
+		 * request from a readhistory file is retried on the next poll.
+		 * A failed schedule read is dropped rather than retried, so a
+		 * meter that won't answer it doesn't stall the bus every cycle.
+		 */
+		TAILQ_FOREACH_SAFE(req, &m->requests, entry, next) {
+			switch (req->op) {
+			    case CTL_HISTORY:
+				result = readhistory(con, &history);
+				if (result == 1)
+					log_history(&reply, &history);
+				break;
+			    case CTL_SCHEDULE:
+				result = scheduleread(con, &schedule);
+				if (result != 1 || (m->have_schedule &&
+				    !memcmp(m->schedule.crc, schedule.crc,
+				    sizeof(schedule.crc))))
+					break;
+				m->schedule = schedule;
+				m->have_schedule = 1;
+				meter_tariff_init(&m->tariff, &schedule);
+				log_schedule(&schedule);
+				break;
+			    case CTL_SETTIME:
+				result = meter_login(con, password);
+				if (result == 1)
+					result = set_time(con);
+				break;
+			}
+			if (result != 1 && req->client == NULL &&
+			    req->op == CTL_HISTORY)
+				continue;
+			if (result == 1 && req->client == NULL &&
+			    req->op == CTL_HISTORY) {
+				snprintf(path, sizeof(path),
+				    "%sreadhistory.%llu", workdir,
+				    m->handle.address);
+				unlink(path);
 			}
-			unlink(path);
+			ctl_done(m, req, result);
 		}
-		//scheduleread(con, &schedule);
 
 close:
 		/* Close the meter connection */
 		meter_close(con);
 		}
-		fclose(fp);
+		out_flush();
 	}
 
+	wal_commit();
 	exit(EX_OK);
 }
@@ -55,30 +55,82 @@ struct meter_history {
 	struct meter_tou reverse[6];
 };
 
+#define	EKM_SCHEDULES	8
+#define	EKM_PERIODS	4
+#define	EKM_SEASONS	4
+#define	EKM_HOLIDAYS	20
+
+struct meter_period {
+	u_int8_t	 hour;
+	u_int8_t	 min;
+	u_int8_t	 rate;
+};
+
+struct meter_season {
+	u_int8_t	 month;
+	u_int8_t	 day;
+	u_int8_t	 schedule;
+};
+
+struct meter_holiday {
+	u_int8_t	 month;
+	u_int8_t	 day;
+};
+
+/*
+ * Schedule, rate and season numbers are as the meter reports them,
+ * counting from 1.  Unused entries are 0.  crc holds the CRCs of the
+ * three replies, so a reread can be compared with the previous one.
+ */
 struct meter_schedule {
-	struct {
-		u_int8_t	 hour;
-		u_int8_t	 min;
-		u_int8_t	 rate;
-	} schedule[6];
-	struct {
-		u_int8_t	 month;
-		u_int8_t	 day;
-		u_int8_t	 schedule;
-	} season[4];
-	struct {
-		u_int8_t	month;
-		u_int8_t	day;
-	} hoiday[20];
-	u_int8_t	weekend_schedule;
-	u_int8_t	holiday_schedule;
+	struct meter_period	 schedule[EKM_SCHEDULES][EKM_PERIODS];
+	struct meter_season	 season[EKM_SEASONS];
+	struct meter_holiday	 holiday[EKM_HOLIDAYS];
+	u_int8_t		 weekend_schedule;
+	u_int8_t		 holiday_schedule;
+	u_int16_t		 crc[3];
+};
+
+/*
+ * Lookup tables built from a meter_schedule by meter_tariff_init().
+ * day[][][1] is used on Saturdays and Sundays.  meter_tariff_rate_time()
+ * caches the local time it last looked up from cache_start to cache_end.
+ */
+struct meter_tariff {
+	u_int8_t	 day[12][31][2];
+	u_int8_t	 rate[EKM_SCHEDULES][24 * 60];
+	time_t		 cache_start;
+	time_t		 cache_end;
+	int		 cache_minute;
+	u_int8_t	 cache_schedule;
+};
+
+/*
+ * Per meter state that stays constant between polls.  The close and open
+ * command frames are built once by meter_handle_init() so that polling a
+ * meter costs a single write().
+ */
+struct meter_handle {
+	u_int64_t	 address;
+	size_t		 open_len;
+	char		 open_frame[32];
 };
 
 uint16_t ekmcrc(const void const *, uint16_t);
+int ekm_seal(char *, int);
+int ekm_connect(const char *);
 void ekm_flush(int);
+time_t ekm_time(const char *);
+void meter_handle_init(struct meter_handle *, u_int64_t);
 int meter_open(int, struct meter_response *, u_int64_t);
+int meter_open_handle(int, struct meter_response *,
+    const struct meter_handle *);
+int meter_open_v4(int, struct meter_response *, u_int64_t);
 int meter_login(int, char *);
 void meter_close(int);
 int readhistory(int, struct meter_history *);
 int set_time(int);
 int scheduleread(int, struct meter_schedule *);
+void meter_tariff_init(struct meter_tariff *, const struct meter_schedule *);
+int meter_tariff_rate(const struct meter_tariff *, int, int, int, int, int);
+int meter_tariff_rate_time(struct meter_tariff *, time_t);
@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/file.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "ekm.h"
+#include "ekmd.h"
+
+struct meter	**meters;
+int		  nmeters;
+
+static int	  maxmeters;
+static int	  ctl_eventq = -1;
+static const char	*ctl_inventory;
+static TAILQ_HEAD(, ctl_client) ctl_dead = TAILQ_HEAD_INITIALIZER(ctl_dead);
+
+static const char * const ctl_ops[] = { "history", "schedule", "settime" };
+
+struct meter *
+meter_find(u_int64_t serial)
+{
+	int	 i;
+
+	for (i = 0; i < nmeters; i++)
+		if (meters[i]->handle.address == serial)
+			return(meters[i]);
+	return(NULL);
+}
+
+struct meter *
+meter_add(u_int64_t serial)
+{
+	struct meter	**new, *m;
+
+	if (nmeters == maxmeters) {
+		new = realloc(meters, (maxmeters + 64) * sizeof(*meters));
+		if (new == NULL)
+			return(NULL);
+		meters = new;
+		maxmeters += 64;
+	}
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		return(NULL);
+	meter_handle_init(&m->handle, serial);
+	TAILQ_INIT(&m->requests);
+	ctl_enqueue(m, CTL_SCHEDULE, NULL);
+	meters[nmeters++] = m;
+
+	return(m);
+}
+
+void
+meter_remove(struct meter *m)
+{
+	struct ctl_request	*req;
+	int			 i;
+
+	while ((req = TAILQ_FIRST(&m->requests)) != NULL)
+		ctl_done(m, req, 0);
+	for (i = 0; i < nmeters; i++)
+		if (meters[i] == m) {
+			meters[i] = meters[--nmeters];
+			break;
+		}
+	free(m);
+}
+
+/*
+ * The inventory is a list of meter serial numbers, one per line.
+ */
+int
+inventory_load(const char *path)
+{
+	FILE		*fp;
+	char		 line[64];
+	u_int64_t	 serial;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return(-1);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%llu", &serial) != 1)
+			continue;
+		if (meter_find(serial) == NULL && meter_add(serial) == NULL) {
+			syslog(LOG_ERR, "Out of memory adding meter %llu",
+			    serial);
+			break;
+		}
+	}
+	fclose(fp);
+
+	return(nmeters);
+}
+
+/*
+ * Discovery and the control socket both edit the inventory, so each edit
+ * rereads it under a lock and changes only the one serial number.  The
+ * lock is on a file of its own, as the inventory is replaced by rename().
+ */
+static int
+inventory_edit(const char *path, u_int64_t serial, int add)
+{
+	FILE		*in, *out;
+	char		 tmp[1024], line[64];
+	u_int64_t	 s;
+	int		 lock, found, result;
+
+	snprintf(tmp, sizeof(tmp), "%s.lock", path);
+	if ((lock = open(tmp, O_RDWR | O_CREAT, 0666)) == -1 ||
+	    flock(lock, LOCK_EX) == -1) {
+		syslog(LOG_ERR, "Can't lock %s: %m", tmp);
+		if (lock != -1)
+			close(lock);
+		return(-1);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((out = fopen(tmp, "w")) == NULL) {
+		syslog(LOG_ERR, "Can't write %s: %m", tmp);
+		close(lock);
+		return(-1);
+	}
+	found = 0;
+	if ((in = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (sscanf(line, "%llu", &s) == 1 && s == serial) {
+				found = 1;
+				if (!add)
+					continue;
+			}
+			fputs(line, out);
+			if (strchr(line, '\n') == NULL)
+				fputc('\n', out);
+		}
+		fclose(in);
+	}
+	if (add && !found)
+		fprintf(out, "%llu\n", serial);
+	result = 0;
+	if (fclose(out) == EOF || rename(tmp, path) == -1) {
+		syslog(LOG_ERR, "Can't update %s: %m", path);
+		unlink(tmp);
+		result = -1;
+	}
+	close(lock);
+
+	return(result);
+}
+
+int
+inventory_add(const char *path, u_int64_t serial)
+{
+	return(inventory_edit(path, serial, 1));
+}
+
+int
+inventory_remove(const char *path, u_int64_t serial)
+{
+	return(inventory_edit(path, serial, 0));
+}
+
+/*
+ * Listen for commands on a local socket.  One command per line:
+ *
+ *	history <serial>	read the 6 month history into the log
+ *	schedule <serial>	read the TOU schedules
+ *	settime <serial>	set the meter clock
+ *	add <serial>		start polling a meter
+ *	remove <serial>		stop polling a meter
+ *	rate <milliseconds>	change the polling interval
+ *
+ * Each command is answered with a line starting with "OK" or "ERR".
+ * Commands that need the bus are answered once the meter has been polled.
+ */
+int
+ctl_listen(int eventq, const char *path, const char *inventory)
+{
+	struct sockaddr_un	 sun;
+	struct kevent		 event;
+	int			 sock;
+
+	ctl_eventq = eventq;
+	ctl_inventory = inventory;
+
+	memset(&sun, '\0', sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		syslog(LOG_ERR, "Control socket path too long: %s", path);
+		return(-1);
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		syslog(LOG_ERR, "socket: %m");
+		return(-1);
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(sock, 16) == -1) {
+		syslog(LOG_ERR, "Can't listen on %s: %m", path);
+		close(sock);
+		return(-1);
+	}
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	EV_SET(&event, sock, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	kevent(eventq, &event, 1, NULL, 0, NULL);
+
+	return(sock);
+}
+
+void
+ctl_accept(int sock)
+{
+	struct ctl_client	*c;
+	struct kevent		 event;
+	int			 fd;
+
+	if ((fd = accept(sock, NULL, NULL)) == -1)
+		return;
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	c->fd = fd;
+	c->refs = 1;
+	EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, c);
+	kevent(ctl_eventq, &event, 1, NULL, 0, NULL);
+}
+
+/*
+ * A client is freed once it has hung up and all of its requests have been
+ * answered.  Events for it may still be waiting in the current kevent()
+ * batch, so it is only freed by ctl_reap() once the batch is done.
+ */
+static void
+ctl_release(struct ctl_client *c)
+{
+	if (--c->refs == 0)
+		TAILQ_INSERT_TAIL(&ctl_dead, c, entry);
+}
+
+void
+ctl_reap(void)
+{
+	struct ctl_client	*c;
+
+	while ((c = TAILQ_FIRST(&ctl_dead)) != NULL) {
+		TAILQ_REMOVE(&ctl_dead, c, entry);
+		free(c);
+	}
+}
+
+/*
+ * Write as much of the queued output as the socket takes.  If any is left,
+ * wait for the socket to drain and stop reading commands until it has.
+ * If the client has gone, the output is dropped and the read side notices
+ * the hangup.
+ */
+static void
+ctl_flush(struct ctl_client *c)
+{
+	struct kevent	 event[2];
+	ssize_t		 n;
+
+	if ((n = write(c->fd, c->out, c->outlen)) == -1) {
+		if (errno != EINTR && errno != EAGAIN) {
+			c->outlen = 0;
+			return;
+		}
+		n = 0;
+	}
+	c->outlen -= n;
+	memmove(c->out, c->out + n, c->outlen);
+	if (c->outlen == 0)
+		return;
+	EV_SET(&event[0], c->fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, c);
+	EV_SET(&event[1], c->fd, EVFILT_READ, EV_DISABLE, 0, 0, c);
+	kevent(ctl_eventq, event, 2, NULL, 0, NULL);
+}
+
+void
+ctl_output(struct ctl_client *c)
+{
+	struct kevent	 event;
+
+	if (c->fd == -1 || c->outlen == 0)
+		return;
+	ctl_flush(c);
+	if (c->outlen == 0) {
+		EV_SET(&event, c->fd, EVFILT_READ, EV_ENABLE, 0, 0, c);
+		kevent(ctl_eventq, &event, 1, NULL, 0, NULL);
+	}
+}
+
+/*
+ * Queue a reply.  A client that lets answers to its requests back up past
+ * the queue is disconnected.
+ */
+static void
+ctl_printf(struct ctl_client *c, const char *fmt, ...)
+{
+	va_list	 ap;
+	size_t	 queued;
+	int	 len;
+
+	if (c == NULL || c->fd == -1)
+		return;
+	queued = c->outlen;
+	va_start(ap, fmt);
+	len = vsnprintf(c->out + queued, sizeof(c->out) - queued, fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= sizeof(c->out) - queued) {
+		syslog(LOG_NOTICE, "Control client not reading, disconnecting");
+		shutdown(c->fd, SHUT_RDWR);
+		c->outlen = 0;
+		return;
+	}
+	c->outlen += len;
+	/* Otherwise a write is already waiting for the socket to drain. */
+	if (queued == 0)
+		ctl_flush(c);
+}
+
+void
+ctl_enqueue(struct meter *m, int op, struct ctl_client *c)
+{
+	struct ctl_request	*req;
+
+	if ((req = malloc(sizeof(*req))) == NULL) {
+		ctl_printf(c, "ERR %s %llu out of memory\n", ctl_ops[op],
+		    m->handle.address);
+		return;
+	}
+	req->op = op;
+	req->client = c;
+	if (c != NULL)
+		c->refs++;
+	TAILQ_INSERT_TAIL(&m->requests, req, entry);
+}
+
+void
+ctl_done(struct meter *m, struct ctl_request *req, int result)
+{
+	TAILQ_REMOVE(&m->requests, req, entry);
+	if (req->client != NULL) {
+		if (result == 1)
+			ctl_printf(req->client, "OK %s %llu\n",
+			    ctl_ops[req->op], m->handle.address);
+		else
+			ctl_printf(req->client, "ERR %s %llu failed\n",
+			    ctl_ops[req->op], m->handle.address);
+		ctl_release(req->client);
+	} else if (req->op == CTL_HISTORY)
+		m->marker = 0;
+	free(req);
+}
+
+/*
+ * Answer the client requests for a meter that can't be reached.  Requests
+ * from readhistory files stay queued.
+ */
+void
+ctl_fail(struct meter *m)
+{
+	struct ctl_request	*req, *next;
+
+	TAILQ_FOREACH_SAFE(req, &m->requests, entry, next)
+		if (req->client != NULL)
+			ctl_done(m, req, -1);
+}
+
+static void
+ctl_command(struct ctl_client *c, char *line)
+{
+	struct kevent	 event;
+	struct meter	*m;
+	char		 cmd[16];
+	u_int64_t	 arg;
+	int		 op;
+
+	if (sscanf(line, "%15s %llu", cmd, &arg) != 2) {
+		ctl_printf(c, "ERR syntax\n");
+		return;
+	}
+	for (op = 0; op < sizeof(ctl_ops) / sizeof(ctl_ops[0]); op++)
+		if (!strcmp(cmd, ctl_ops[op]))
+			break;
+	if (op < sizeof(ctl_ops) / sizeof(ctl_ops[0])) {
+		if ((m = meter_find(arg)) == NULL)
+			ctl_printf(c, "ERR %s %llu no such meter\n", cmd, arg);
+		else
+			ctl_enqueue(m, op, c);
+	} else if (!strcmp(cmd, "add")) {
+		if (meter_find(arg) != NULL)
+			ctl_printf(c, "ERR add %llu exists\n", arg);
+		else if (meter_add(arg) == NULL)
+			ctl_printf(c, "ERR add %llu out of memory\n", arg);
+		else {
+			inventory_add(ctl_inventory, arg);
+			ctl_printf(c, "OK add %llu\n", arg);
+		}
+	} else if (!strcmp(cmd, "remove")) {
+		if ((m = meter_find(arg)) == NULL)
+			ctl_printf(c, "ERR remove %llu no such meter\n", arg);
+		else {
+			meter_remove(m);
+			inventory_remove(ctl_inventory, arg);
+			ctl_printf(c, "OK remove %llu\n", arg);
+		}
+	} else if (!strcmp(cmd, "rate")) {
+		if (arg < 100) {
+			ctl_printf(c, "ERR rate %llu too fast\n", arg);
+			return;
+		}
+		EV_SET(&event, 1, EVFILT_TIMER, EV_ADD|EV_ENABLE, 0, arg,
+		    NULL);
+		kevent(ctl_eventq, &event, 1, NULL, 0, NULL);
+		syslog(LOG_NOTICE, "Polling every %llu ms", arg);
+		ctl_printf(c, "OK rate %llu\n", arg);
+	} else
+		ctl_printf(c, "ERR %s unknown command\n", cmd);
+}
+
+void
+ctl_input(struct ctl_client *c)
+{
+	char	*line, *nl;
+	ssize_t	 len;
+
+	len = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+	if (len == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (len <= 0) {
+		close(c->fd);
+		c->fd = -1;
+		c->outlen = 0;
+		ctl_release(c);
+		return;
+	}
+	c->len += len;
+	c->buf[c->len] = '\0';
+
+	for (line = c->buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		*nl = '\0';
+		ctl_command(c, line);
+	}
+	c->len -= line - c->buf;
+	memmove(c->buf, line, c->len);
+	if (c->len == sizeof(c->buf) - 1) {
+		ctl_printf(c, "ERR line too long\n");
+		c->len = 0;
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * Daemon state shared between the poller and the control socket.
+ */
+
+#define	CTL_HISTORY	0
+#define	CTL_SCHEDULE	1
+#define	CTL_SETTIME	2
+
+/*
+ * Replies are queued in out and written as the socket accepts them.  The
+ * queue holds the replies to a full buf of commands.
+ */
+struct ctl_client {
+	TAILQ_ENTRY(ctl_client)	 entry;
+	int			 fd;
+	int			 refs;
+	size_t			 len;
+	char			 buf[256];
+	size_t			 outlen;
+	char			 out[4096];
+};
+
+/*
+ * Anything that needs the bus is queued on the meter it is for and is
+ * carried out the next time that meter is polled.  Requests made by
+ * creating readhistory.<serial> have no client.
+ */
+struct ctl_request {
+	TAILQ_ENTRY(ctl_request)	 entry;
+	int				 op;
+	struct ctl_client		*client;
+};
+
+/*
+ * The schedule is read when a meter is added and on request.  It is only
+ * logged, and the tariff rebuilt from it, when it differs from the copy
+ * held here.
+ */
+struct meter {
+	struct meter_handle		 handle;
+	int				 marker;
+	int				 have_schedule;
+	struct meter_schedule		 schedule;
+	struct meter_tariff		 tariff;
+	TAILQ_HEAD(, ctl_request)	 requests;
+};
+
+extern struct meter	**meters;
+extern int		  nmeters;
+
+struct meter *meter_find(u_int64_t);
+struct meter *meter_add(u_int64_t);
+void meter_remove(struct meter *);
+int inventory_load(const char *);
+int inventory_add(const char *, u_int64_t);
+int inventory_remove(const char *, u_int64_t);
+int ctl_listen(int, const char *, const char *);
+void ctl_accept(int);
+void ctl_input(struct ctl_client *);
+void ctl_output(struct ctl_client *);
+void ctl_reap(void);
+void ctl_enqueue(struct meter *, int, struct ctl_client *);
+void ctl_done(struct meter *, struct ctl_request *, int);
+void ctl_fail(struct meter *);
+int discover(char **, int, u_int64_t, u_int64_t, const char *);
+
+extern long	 wal_interval;
+
+int wal_open(const char *);
+void wal_setlog(int);
+void wal_append(const char *, size_t);
+void wal_commit(void);
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ekm.h"
+#include "ekmd.h"
+
+/*
+ * Bus discovery.  Every bus is swept over the whole address range at the
+ * same time, one probe outstanding per bus.  Empty addresses cost the
+ * probe timeout, so it is kept short and adapts to how quickly meters
+ * actually answer.
+ *
+ * Replies carry the meter address, so one that arrives after we have
+ * moved on is still credited to the right meter.  A late reply can
+ * collide with the next probe though, so when one is seen the timeout is
+ * doubled and the addresses probed recently are probed again at the end
+ * of the sweep with twice the timeout.
+ */
+
+#define	REPLY_LEN	255
+#define	TIMEOUT_MIN	20
+#define	TIMEOUT_INIT	100
+#define	TIMEOUT_MAX	1000
+#define	RECENT		16
+
+struct bus {
+	const char	*name;
+	int		 fd;
+	u_int64_t	 next;		/* next address to probe */
+	u_int64_t	 probing;
+	int		 waiting;
+	long		 sent;		/* ms, when the probe was written */
+	long		 deadline;
+	long		 timeout;
+	long		 srtt, rttvar;
+	size_t		 len;
+	char		 buf[REPLY_LEN];
+	struct {
+		u_int64_t	 address;
+		long		 sent;
+	}		 recent[RECENT];
+	int		 nrecent;
+	u_int64_t	*retry;
+	int		 nretry, maxretry, retrying;
+};
+
+static long
+now_ms(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+bus_retry(struct bus *b, u_int64_t address)
+{
+	u_int64_t	*new;
+	int		 i;
+
+	for (i = 0; i < b->nretry; i++)
+		if (b->retry[i] == address)
+			return;
+	if (b->nretry == b->maxretry) {
+		new = realloc(b->retry, (b->maxretry + 64) * sizeof(*new));
+		if (new == NULL)
+			return;
+		b->retry = new;
+		b->maxretry += 64;
+	}
+	b->retry[b->nretry++] = address;
+}
+
+static void
+bus_probe(struct bus *b, u_int64_t address)
+{
+	struct meter_handle	 handle;
+	int			 i;
+
+	meter_handle_init(&handle, address);
+	ekm_flush(b->fd);
+	write(b->fd, handle.open_frame, handle.open_len);
+	b->probing = address;
+	b->waiting = 1;
+	b->len = 0;
+	b->sent = now_ms();
+	b->deadline = b->sent + b->timeout * (b->retrying ? 2 : 1);
+	i = b->nrecent++ % RECENT;
+	b->recent[i].address = address;
+	b->recent[i].sent = b->sent;
+}
+
+/*
+ * Start the next probe.  Returns 0 once the bus has been swept.
+ */
+static int
+bus_next(struct bus *b, u_int64_t last)
+{
+	if (b->next <= last) {
+		bus_probe(b, b->next++);
+		return(1);
+	}
+	if (b->retrying < b->nretry) {
+		bus_probe(b, b->retry[b->retrying++]);
+		return(1);
+	}
+	b->waiting = 0;
+	return(0);
+}
+
+/*
+ * Track the time to the first byte of a reply like a TCP round trip
+ * time and set the timeout from it.  Meters answer with little jitter,
+ * so the variance starts small.
+ */
+static void
+bus_rtt(struct bus *b, long rtt)
+{
+	if (b->srtt == 0) {
+		b->srtt = rtt;
+		b->rttvar = rtt / 8;
+	} else {
+		b->rttvar = (3 * b->rttvar + labs(b->srtt - rtt)) / 4;
+		b->srtt = (7 * b->srtt + rtt) / 8;
+	}
+	b->timeout = b->srtt + 4 * b->rttvar + TIMEOUT_MIN;
+	if (b->timeout < TIMEOUT_MIN)
+		b->timeout = TIMEOUT_MIN;
+	if (b->timeout > TIMEOUT_MAX)
+		b->timeout = TIMEOUT_MAX;
+}
+
+/*
+ * A reply for an address other than the one being probed arrived, or
+ * noise did: the timeout is too short.
+ */
+static void
+bus_late(struct bus *b, long now)
+{
+	int	 i;
+
+	b->timeout *= 2;
+	if (b->timeout > TIMEOUT_MAX)
+		b->timeout = TIMEOUT_MAX;
+	for (i = 0; i < RECENT && i < b->nrecent; i++)
+		if (now - b->recent[i].sent <= TIMEOUT_MAX)
+			bus_retry(b, b->recent[i].address);
+}
+
+/*
+ * A complete reply.  Returns the address of the meter if it is valid.
+ */
+static u_int64_t
+bus_reply(struct bus *b)
+{
+	u_int16_t	 crc;
+	u_int64_t	 address;
+	int		 i;
+
+	memcpy(&crc, b->buf + REPLY_LEN - sizeof(crc), sizeof(crc));
+	if (ekmcrc(b->buf + 1, REPLY_LEN - (sizeof(crc) + 1)) != ntohs(crc))
+		return(0);
+	for (address = 0, i = 4; i < 16; i++) {
+		if (b->buf[i] < '0' || b->buf[i] > '9')
+			return(0);
+		address = address * 10 + b->buf[i] - '0';
+	}
+	return(address);
+}
+
+static void
+bus_found(struct bus *b, u_int64_t address, const char *inventory)
+{
+	int	 firmware;
+
+	meter_close(b->fd);
+	firmware = b->buf[3];
+	if (meter_find(address) != NULL)
+		return;
+	printf("%s: found meter %llu firmware %d\n", b->name, address,
+	    firmware);
+	if (meter_add(address) != NULL)
+		inventory_add(inventory, address);
+}
+
+static void
+bus_input(struct bus *b, long now, u_int64_t last, const char *inventory)
+{
+	u_int64_t	 address;
+	char		*stx;
+	ssize_t		 len;
+
+	while ((len = read(b->fd, b->buf + b->len,
+	    sizeof(b->buf) - b->len)) > 0) {
+		if (b->len == 0) {
+			if ((stx = memchr(b->buf, '\x02', len)) == NULL)
+				continue;
+			len -= stx - b->buf;
+			memmove(b->buf, stx, len);
+			if (b->waiting && now <= b->deadline)
+				bus_rtt(b, now - b->sent);
+		}
+		b->len += len;
+		/* Give a reply that has started time to finish. */
+		b->deadline = now + TIMEOUT_MAX;
+		if (b->len < sizeof(b->buf))
+			continue;
+		address = bus_reply(b);
+		if (address != b->probing)
+			bus_late(b, now);
+		if (address != 0)
+			bus_found(b, address, inventory);
+		b->len = 0;
+		bus_next(b, last);
+	}
+}
+
+/*
+ * Sweep the address range first to last on each bus and add the meters
+ * found to the inventory.
+ */
+int
+discover(char **names, int nbuses, u_int64_t first, u_int64_t last,
+    const char *inventory)
+{
+	struct bus	*buses;
+	struct pollfd	*pfd;
+	long		 now, wait;
+	int		 i, active, known;
+
+	if ((buses = calloc(nbuses, sizeof(*buses))) == NULL ||
+	    (pfd = calloc(nbuses, sizeof(*pfd))) == NULL) {
+		printf("Out of memory\n");
+		return(-1);
+	}
+	inventory_load(inventory);
+	known = nmeters;
+
+	for (active = 0, i = 0; i < nbuses; i++) {
+		buses[i].name = names[i];
+		buses[i].next = first;
+		buses[i].timeout = TIMEOUT_INIT;
+		if ((buses[i].fd = ekm_connect(names[i])) == -1) {
+			printf("Connection to %s failed\n", names[i]);
+			continue;
+		}
+		ekm_flush(buses[i].fd);
+		active += bus_next(&buses[i], last);
+	}
+
+	while (active > 0) {
+		now = now_ms();
+		wait = TIMEOUT_MAX;
+		for (i = 0; i < nbuses; i++) {
+			pfd[i].fd = buses[i].waiting ? buses[i].fd : -1;
+			pfd[i].events = POLLIN;
+			if (buses[i].waiting && buses[i].deadline - now < wait)
+				wait = buses[i].deadline - now;
+		}
+		if (poll(pfd, nbuses, wait < 0 ? 0 : wait) == -1 &&
+		    errno != EINTR)
+			break;
+		now = now_ms();
+		for (active = 0, i = 0; i < nbuses; i++) {
+			if (!buses[i].waiting)
+				continue;
+			if (pfd[i].revents & POLLIN)
+				bus_input(&buses[i], now, last, inventory);
+			if (buses[i].waiting && now >= buses[i].deadline) {
+				if (buses[i].len != 0)
+					bus_late(&buses[i], now);
+				bus_next(&buses[i], last);
+			}
+			active += buses[i].waiting;
+		}
+	}
+
+	for (i = 0; i < nbuses; i++) {
+		if (buses[i].fd != -1)
+			close(buses[i].fd);
+		free(buses[i].retry);
+	}
+	free(buses);
+	free(pfd);
+
+	return(nmeters - known);
+}
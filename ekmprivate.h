@@ -64,6 +64,8 @@ static const uint16_t const ekmcrclut[256] = {
 #define	EKM_PASSWORD	"\01P1\02(%s)\03"
 #define	EKM_TIME	"\01W1\02" "0060(%02d%02d%02d%02d%02d%02d%02d)\03"
 #define	EKM_METER_OPEN	"/?%012llu!\r\n"
+#define	EKM_METER_OPEN_A	"/?%012llu00!\r\n"
+#define	EKM_METER_OPEN_B	"/?%012llu01!\r\n"
 #define	EKM_METER_CLOSE	"\x01" "B0\x03\x75"
 #define	EKM_6MONTH_TOTAL	"\x01R1\x02" "0011\x03"
 #define	EKM_6MONTH_REV	"\x01R1\x02" "0012\x03"
@@ -71,11 +73,46 @@ static const uint16_t const ekmcrclut[256] = {
 #define	EKM_SCHEDULE2	"\x01R1\x02" "0071\x03"
 #define	EKM_SCHEDULE_HOLIDAY	"\x01R1\x02" "00B0\x03"
 
+/*
+ * Every reply is EKM_REPLY_LEN bytes and ends with a CRC over everything
+ * after the first byte.  The layouts below are checked against that, and
+ * against the offsets documented in EKM_Response, when this is compiled.
+ */
+#define	EKM_REPLY_LEN	255
+
+#define	EKM_CHECK_OFFSET(type, member, off)				\
+	_Static_assert(offsetof(struct type, member) == (off),		\
+	    #type "." #member " is not at offset " #off)
+#define	EKM_CHECK_REPLY(type)						\
+	_Static_assert(sizeof(struct type) == EKM_REPLY_LEN,		\
+	    #type " is not a whole reply");				\
+	EKM_CHECK_OFFSET(type, crc, EKM_REPLY_LEN - sizeof(u_int16_t))
+
+/*
+ * Each reply's fields are listed once, as F(kind, reply field, scale,
+ * response member).  The decoders in libekm.c are generated from these
+ * lists; field widths come from the layouts, so none are written twice.
+ * The v4 lists take the scale of their kWh readings as an argument.
+ *
+ *	INT	unsigned decimal
+ *	FIXED	decimal with scale digits after an implied point
+ *	PF	'C' (capacitive, negative) or 'L' then a value in hundredths
+ *	CHAR	the character as is
+ *	TIME	the meter's YYMMDDWWHHMMSS clock
+ */
+
 struct _tou_meter {
 	char	 total_kwh[8];
 	char	 tou[4][8];
 } __attribute__ ((packed));
 
+#define	EKM_TOU_FIELDS(F)						\
+	F(FIXED, total_kwh, 1, total)					\
+	F(FIXED, tou[0], 1, tou[0])					\
+	F(FIXED, tou[1], 1, tou[1])					\
+	F(FIXED, tou[2], 1, tou[2])					\
+	F(FIXED, tou[3], 1, tou[3])
+
 /*
  * Meter response to Open
  */
@@ -106,48 +143,241 @@ struct _ekmv3reply {
 	u_int16_t		 crc;
 } __attribute__ ((packed));
 
+EKM_CHECK_REPLY(_ekmv3reply);
+EKM_CHECK_OFFSET(_ekmv3reply, total, 16);
+EKM_CHECK_OFFSET(_ekmv3reply, volts, 96);
+EKM_CHECK_OFFSET(_ekmv3reply, pf, 151);
+EKM_CHECK_OFFSET(_ekmv3reply, demand_period, 171);
+EKM_CHECK_OFFSET(_ekmv3reply, date, 172);
+EKM_CHECK_OFFSET(_ekmv3reply, pulse, 190);
+EKM_CHECK_OFFSET(_ekmv3reply, pulse_h_l, 229);
+
+#define	EKM_V3_FIELDS(F)						\
+	F(CHAR, firmware, 0, firmware)					\
+	F(FIXED, volts[0], 1, volts[0])					\
+	F(FIXED, volts[1], 1, volts[1])					\
+	F(FIXED, volts[2], 1, volts[2])					\
+	F(FIXED, amps[0], 1, amps[0])					\
+	F(FIXED, amps[1], 1, amps[1])					\
+	F(FIXED, amps[2], 1, amps[2])					\
+	F(INT, power[0], 0, power[0])					\
+	F(INT, power[1], 0, power[1])					\
+	F(INT, power[2], 0, power[2])					\
+	F(INT, total_power, 0, total_power)				\
+	F(PF, pf[0], 0, pf[0])						\
+	F(PF, pf[1], 0, pf[1])						\
+	F(PF, pf[2], 0, pf[2])						\
+	F(INT, max_demand, 0, max_demand)				\
+	F(CHAR, demand_period, 0, demand_period)			\
+	F(TIME, date, 0, time)						\
+	F(INT, ct_size, 0, ct_size)					\
+	F(INT, pulse[0], 0, pulse[0])					\
+	F(INT, pulse[1], 0, pulse[1])					\
+	F(INT, pulse[2], 0, pulse[2])					\
+	F(INT, pulseratio[0], 0, pulseratio[0])				\
+	F(INT, pulseratio[1], 0, pulseratio[1])				\
+	F(INT, pulseratio[2], 0, pulseratio[2])				\
+	F(CHAR, pulse_h_l[0], 0, pulsetrigger[0])			\
+	F(CHAR, pulse_h_l[1], 0, pulsetrigger[1])			\
+	F(CHAR, pulse_h_l[2], 0, pulsetrigger[2])
+
+/*
+ * v4 Omnimeter response to Open with request A
+ */
+struct _ekmv4replya {
+	char			 start;
+	char			 model[2];
+	char			 firmware;
+	char			 address[12];
+	char			 kwh_total[8];
+	char			 reactive_energy_total[8];
+	char			 rev_kwh_total[8];
+	char			 kwh_line[3][8];
+	char			 rev_kwh_line[3][8];
+	char			 resettable_kwh_total[8];
+	char			 resettable_rev_kwh_total[8];
+	char			 volts[3][4];
+	char			 amps[3][5];
+	char			 power[3][7];
+	char			 total_power[7];
+	char			 pf[3][4];
+	char			 reactive_power[3][7];
+	char			 reactive_power_total[7];
+	char			 frequency[4];
+	char			 pulse[3][8];
+	char			 state_inputs;
+	char			 state_watts_dir;
+	char			 state_out;
+	char			 kwh_scale;
+	char			 reserved1[2];
+	char			 date[14];
+	char			 reserved2[2];
+	char			 pad[3];
+	char			 end;
+	u_int16_t		 crc;
+} __attribute__ ((packed));
+
+EKM_CHECK_REPLY(_ekmv4replya);
+EKM_CHECK_OFFSET(_ekmv4replya, volts, 104);
+EKM_CHECK_OFFSET(_ekmv4replya, date, 233);
+
+#define	EKM_V4A_FIELDS(F, kwh)						\
+	F(CHAR, firmware, 0, firmware)					\
+	F(FIXED, kwh_total, kwh, forward.total)				\
+	F(FIXED, rev_kwh_total, kwh, reverse.total)			\
+	F(FIXED, volts[0], 1, volts[0])					\
+	F(FIXED, volts[1], 1, volts[1])					\
+	F(FIXED, volts[2], 1, volts[2])					\
+	F(FIXED, amps[0], 1, amps[0])					\
+	F(FIXED, amps[1], 1, amps[1])					\
+	F(FIXED, amps[2], 1, amps[2])					\
+	F(INT, power[0], 0, power[0])					\
+	F(INT, power[1], 0, power[1])					\
+	F(INT, power[2], 0, power[2])					\
+	F(INT, total_power, 0, total_power)				\
+	F(PF, pf[0], 0, pf[0])						\
+	F(PF, pf[1], 0, pf[1])						\
+	F(PF, pf[2], 0, pf[2])						\
+	F(INT, pulse[0], 0, pulse[0])					\
+	F(INT, pulse[1], 0, pulse[1])					\
+	F(INT, pulse[2], 0, pulse[2])					\
+	F(TIME, date, 0, time)
+
+/*
+ * v4 Omnimeter response to Open with request B
+ */
+struct _ekmv4replyb {
+	char			 start;
+	char			 model[2];
+	char			 firmware;
+	char			 address[12];
+	char			 kwh_tariff[4][8];
+	char			 rev_kwh_tariff[4][8];
+	char			 volts[3][4];
+	char			 amps[3][5];
+	char			 power[3][7];
+	char			 total_power[7];
+	char			 pf[3][4];
+	char			 max_demand[8];
+	char			 demand_period;
+	char			 pulseratio[3][4];
+	char			 ct_size[4];
+	char			 auto_reset_max_demand;
+	char			 kwh_constant[4];
+	char			 reserved1[56];
+	char			 date[14];
+	char			 reserved2[2];
+	char			 pad[3];
+	char			 end;
+	u_int16_t		 crc;
+} __attribute__ ((packed));
+
+EKM_CHECK_REPLY(_ekmv4replyb);
+EKM_CHECK_OFFSET(_ekmv4replyb, volts, 80);
+EKM_CHECK_OFFSET(_ekmv4replyb, date, 233);
+
+/*
+ * Tariff readings carry no kWh scale of their own; request A's applies.
+ */
+#define	EKM_V4B_FIELDS(F, kwh)						\
+	F(FIXED, kwh_tariff[0], kwh, forward.tou[0])			\
+	F(FIXED, kwh_tariff[1], kwh, forward.tou[1])			\
+	F(FIXED, kwh_tariff[2], kwh, forward.tou[2])			\
+	F(FIXED, kwh_tariff[3], kwh, forward.tou[3])			\
+	F(FIXED, rev_kwh_tariff[0], kwh, reverse.tou[0])		\
+	F(FIXED, rev_kwh_tariff[1], kwh, reverse.tou[1])		\
+	F(FIXED, rev_kwh_tariff[2], kwh, reverse.tou[2])		\
+	F(FIXED, rev_kwh_tariff[3], kwh, reverse.tou[3])		\
+	F(INT, max_demand, 0, max_demand)				\
+	F(CHAR, demand_period, 0, demand_period)			\
+	F(INT, pulseratio[0], 0, pulseratio[0])				\
+	F(INT, pulseratio[1], 0, pulseratio[1])				\
+	F(INT, pulseratio[2], 0, pulseratio[2])				\
+	F(INT, ct_size, 0, ct_size)
+
 struct _ekm_schedule_entry {
-	char	 start[4];
-	char	 pad;
-	char	 rate;
+	char	 hour[2];
+	char	 min[2];
+	char	 rate[2];
 } __attribute__ ((packed));
 
+#define	EKM_PERIOD_FIELDS(F)						\
+	F(INT, hour, 0, hour)						\
+	F(INT, min, 0, min)						\
+	F(INT, rate, 0, rate)
+
 struct _ekm_schedule_table {
-	struct _ekm_schedule_entry	 table[5];
+	struct _ekm_schedule_entry	 table[4];
+	char				 pad[24];
+} __attribute__ ((packed));
+
+struct _ekm_season_entry {
+	char	 month[2];
+	char	 day[2];
+	char	 schedule[2];
+} __attribute__ ((packed));
+
+#define	EKM_SEASON_FIELDS(F)						\
+	F(INT, month, 0, month)						\
+	F(INT, day, 0, day)						\
+	F(INT, schedule, 0, schedule)
+
+struct _ekm_season_table {
+	struct _ekm_season_entry	 table[4];
 	char				 pad[24];
 } __attribute__ ((packed));
 
 /*
- * Response to Read Period Tables
+ * Response to Read Period Tables.  EKM_SCHEDULE1 returns schedules 1-4
+ * and EKM_SCHEDULE2 schedules 5-8.  The season table is taken from the
+ * EKM_SCHEDULE2 response, see EKM_Response.
  */
 struct period_table {
 	char				 start;
 	char				 header[4];
 	char				 delim_start;
 	struct _ekm_schedule_table	 schedule[4];
-	struct _ekm_schedule_table	 season;
+	struct _ekm_season_table	 season;
 	char				 pad[5];
 	char				 delim_end;
 	char				 end;
 	u_int16_t			 crc;
 } __attribute__ ((packed));
 
+EKM_CHECK_REPLY(period_table);
+EKM_CHECK_OFFSET(period_table, season, 198);
+
+struct _ekm_holiday {
+	char	 month[2];
+	char	 day[2];
+} __attribute__ ((packed));
+
+#define	EKM_HOLIDAY_FIELDS(F)						\
+	F(INT, month, 0, month)						\
+	F(INT, day, 0, day)
+
 /*
  * meter response to read Holidays
  */
 struct _ekm_meter_holidays {
-	char		 start;
-	char		 header[4];
-	char		 delim_start;
-	char		 holidays[20][4];
-	char		 weekend_sched[2];
-	char		 holiday_sched[2];
-	char		 reserved[161];
-	char		 delim_end;
-	char		 end;
-	u_int16_t	 crc;
+	char			 start;
+	char			 header[4];
+	char			 delim_start;
+	struct _ekm_holiday	 holidays[20];
+	char			 weekend_sched[2];
+	char			 holiday_sched[2];
+	char			 reserved[161];
+	char			 delim_end;
+	char			 end;
+	u_int16_t		 crc;
 } __attribute__ ((packed));
 
+EKM_CHECK_REPLY(_ekm_meter_holidays);
+
+#define	EKM_HOLIDAYS_FIELDS(F)						\
+	F(INT, weekend_sched, 0, weekend_schedule)			\
+	F(INT, holiday_sched, 0, holiday_schedule)
+
 /*
  * Meter response to read last 6 months history.
  * Total and Reverse responses use this structure.
@@ -157,8 +387,10 @@ struct _ekm_meter_history {
 	char			 header[4];
 	char			 delim_start;
 	struct _tou_meter	 month[6];
-	char			 reserved[6];
+	char			 reserved[5];
 	char			 delim_end;
 	char			 end;
 	u_int16_t		 crc;
 } __attribute__ ((packed));
+
+EKM_CHECK_REPLY(_ekm_meter_history);
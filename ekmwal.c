@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ekm.h"
+#include "ekmd.h"
+
+/*
+ * Write-ahead log for readings.
+ *
+ * Each polling cycle's readings are appended to the WAL as one checksummed
+ * record.  Records are made durable in groups: the WAL is fsync()ed once
+ * the oldest record in the group has waited wal_interval milliseconds and
+ * only then is the group appended to the reading log.  The reading log is
+ * fsync()ed when the WAL is checkpointed, which empties it unless some
+ * records are still waiting to be appended.
+ *
+ * The WAL starts with two header slots, written alternately so that one
+ * is always intact.  The newer one records the size of the reading log at
+ * the last checkpoint and the last record that was in it.  Recovery cuts
+ * the reading log back to that size and appends every intact record after
+ * it, stopping at the first torn or corrupt record.
+ */
+
+#define	WAL_MAGIC	0x454b4d57	/* EKMW */
+#define	WAL_RECMAGIC	0x454b4d52	/* EKMR */
+#define	WAL_SLOT	64
+#define	WAL_DATA	(2 * WAL_SLOT)
+#define	WAL_CHECKPOINT	(256 * 1024)
+#define	WAL_MAXREC	(1024 * 1024)
+#define	WAL_GROUP	(64 * 1024)
+
+struct wal_header {
+	u_int32_t	 magic;
+	u_int32_t	 crc;
+	u_int64_t	 generation;
+	u_int64_t	 applied;
+	u_int64_t	 log_ino;
+	u_int64_t	 log_size;
+};
+
+struct wal_record {
+	u_int32_t	 magic;
+	u_int32_t	 len;
+	u_int64_t	 seq;
+	u_int32_t	 crc;
+	u_int32_t	 pad;
+};
+
+long		 wal_interval = 5000;
+
+static int	 walfd = -1;
+static int	 wal_logfd = -1;
+static off_t	 wal_size;
+static u_int64_t wal_generation;
+static u_int64_t wal_seq;		/* last record written */
+static u_int64_t wal_applied;		/* last record in the log */
+static char	*group;
+static size_t	 group_len, group_done, group_max;
+static long	 group_start;
+static int	 group_walled = 1;	/* every group record is in the WAL */
+static int	 wal_recovered;
+
+static u_int32_t
+crc32(u_int32_t crc, const void *buf, size_t len)
+{
+	static u_int32_t	 table[256];
+	const u_int8_t		*p = buf;
+	u_int32_t		 c;
+	int			 i, j;
+
+	if (table[1] == 0)
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	for (crc = ~crc; len--; p++)
+		crc = table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+	return(~crc);
+}
+
+static u_int32_t
+wal_reccrc(struct wal_record *rec, const void *data)
+{
+	struct wal_record	 r;
+
+	r = *rec;
+	r.crc = 0;
+	return(crc32(crc32(0, &r, sizeof(r)), data, rec->len));
+}
+
+static long
+wal_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Write len bytes, counting them in *done so that a failed write can be
+ * resumed without repeating anything.
+ */
+static int
+wal_write(int fd, const char *buf, size_t len, size_t *done)
+{
+	ssize_t	 n;
+
+	while (*done < len) {
+		if ((n = write(fd, buf + *done, len - *done)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return(-1);
+		}
+		*done += n;
+	}
+	return(0);
+}
+
+/*
+ * Make everything applied so far durable in the reading log, record that
+ * in the WAL header and empty the WAL if nothing in it is still pending.
+ */
+static int
+wal_checkpoint(void)
+{
+	struct wal_header	 h;
+	struct stat		 sb;
+
+	if (walfd == -1 || wal_logfd == -1)
+		return(-1);
+	if (fsync(wal_logfd) == -1 || fstat(wal_logfd, &sb) == -1) {
+		syslog(LOG_ERR, "Checkpoint failed: %m");
+		return(-1);
+	}
+	memset(&h, '\0', sizeof(h));
+	h.magic = WAL_MAGIC;
+	h.generation = ++wal_generation;
+	h.applied = wal_applied;
+	h.log_ino = sb.st_ino;
+	h.log_size = sb.st_size;
+	h.crc = crc32(0, &h, sizeof(h));
+	if (pwrite(walfd, &h, sizeof(h), (h.generation % 2) * WAL_SLOT) !=
+	    sizeof(h) || fsync(walfd) == -1) {
+		syslog(LOG_ERR, "WAL header write failed: %m");
+		return(-1);
+	}
+	/*
+	 * Records up to wal_applied are skipped on recovery anyway.  Any after
+	 * it are still waiting in the group and must survive until applied.
+	 */
+	if (wal_applied == wal_seq && ftruncate(walfd, WAL_DATA) == 0)
+		wal_size = WAL_DATA;
+
+	return(0);
+}
+
+static int
+wal_header_read(struct wal_header *h)
+{
+	struct wal_header	 slot[2];
+	u_int32_t		 crc;
+	int			 i, valid;
+
+	for (valid = -1, i = 0; i < 2; i++) {
+		if (pread(walfd, &slot[i], sizeof(slot[i]), i * WAL_SLOT) !=
+		    sizeof(slot[i]) || slot[i].magic != WAL_MAGIC)
+			continue;
+		crc = slot[i].crc;
+		slot[i].crc = 0;
+		if (crc32(0, &slot[i], sizeof(slot[i])) != crc)
+			continue;
+		if (valid == -1 || slot[i].generation > slot[valid].generation)
+			valid = i;
+	}
+	if (valid == -1)
+		return(-1);
+	*h = slot[valid];
+
+	return(0);
+}
+
+/*
+ * Bring the reading log up to date from the WAL.  If the log can't be
+ * written, whatever part of a record made it there is cut off again and
+ * the WAL is left as it is, so that recovery can be retried.
+ */
+static int
+wal_recover(void)
+{
+	struct wal_header	 h;
+	struct wal_record	 rec;
+	struct stat		 sb;
+	char			*data;
+	off_t			 off, logsize;
+	size_t			 done;
+	int			 replayed, failed;
+
+	if (wal_header_read(&h) == -1)
+		return(0);
+	wal_generation = h.generation;
+	wal_seq = wal_applied = h.applied;
+
+	if (fstat(wal_logfd, &sb) == -1)
+		return(-1);
+	logsize = sb.st_size;
+	if (sb.st_ino != h.log_ino)
+		syslog(LOG_NOTICE, "Reading log was replaced, recovered "
+		    "readings may be duplicated");
+	else if (sb.st_size > h.log_size) {
+		if (ftruncate(wal_logfd, h.log_size) == -1) {
+			syslog(LOG_ERR, "Can't truncate reading log: %m");
+			return(-1);
+		}
+		logsize = h.log_size;
+	}
+
+	if ((data = malloc(WAL_MAXREC)) == NULL)
+		return(-1);
+	replayed = failed = 0;
+	for (off = WAL_DATA;; off += sizeof(rec) + rec.len) {
+		if (pread(walfd, &rec, sizeof(rec), off) != sizeof(rec) ||
+		    rec.magic != WAL_RECMAGIC || rec.len > WAL_MAXREC ||
+		    pread(walfd, data, rec.len, off + sizeof(rec)) != rec.len ||
+		    wal_reccrc(&rec, data) != rec.crc)
+			break;
+		if (rec.seq > wal_seq)
+			wal_seq = rec.seq;
+		if (rec.seq <= wal_applied || failed)
+			continue;
+		done = 0;
+		if (wal_write(wal_logfd, data, rec.len, &done) == -1) {
+			syslog(LOG_ERR, "WAL replay failed: %m");
+			if (done != 0 && ftruncate(wal_logfd, logsize) == -1)
+				syslog(LOG_ERR, "Can't truncate reading log: "
+				    "%m");
+			failed = 1;
+			continue;
+		}
+		logsize += rec.len;
+		wal_applied = rec.seq;
+		replayed++;
+	}
+	free(data);
+	if (!failed && lseek(walfd, 0, SEEK_END) > off) {
+		syslog(LOG_NOTICE, "Discarded torn WAL tail at %lld",
+		    (long long)off);
+		ftruncate(walfd, off);
+	}
+	wal_size = off;
+	if (replayed)
+		syslog(LOG_NOTICE, "Recovered %d WAL records", replayed);
+
+	return(failed ? -1 : 0);
+}
+
+/*
+ * Recover if that has not been done yet.  The group's records were
+ * replayed with the rest if they all reached the WAL.
+ */
+static int
+wal_catchup(void)
+{
+	if (wal_recovered)
+		return(0);
+	if (wal_recover() == -1)
+		return(-1);
+	wal_recovered = 1;
+	if (group_walled)
+		group_len = group_done = 0;
+
+	return(0);
+}
+
+int
+wal_open(const char *path)
+{
+	if ((walfd = open(path, O_RDWR | O_CREAT, 0666)) == -1) {
+		syslog(LOG_ERR, "Can't open %s: %m", path);
+		return(-1);
+	}
+	if ((wal_size = lseek(walfd, 0, SEEK_END)) < WAL_DATA)
+		wal_size = WAL_DATA;
+	return(0);
+}
+
+/*
+ * Switch to a new reading log, recovering into it the first time.  What
+ * was applied to the old log is made durable there before the switch; the
+ * rest of the group goes to the new one.  A logfd of -1 leaves the group
+ * in the WAL until a log is set again.
+ */
+void
+wal_setlog(int logfd)
+{
+	if (wal_logfd != -1)
+		wal_checkpoint();
+	wal_logfd = logfd;
+	if (group_done != 0) {
+		group_len -= group_done;
+		memmove(group, group + group_done, group_len);
+		group_done = 0;
+	}
+	if (walfd != -1 && logfd != -1)
+		wal_catchup();
+	wal_checkpoint();
+}
+
+/*
+ * Make the group durable and append it to the reading log.  Until
+ * recovery has succeeded the group waits, as it must follow the records
+ * being recovered.
+ */
+void
+wal_commit(void)
+{
+	if (group_len == 0)
+		return;
+	if (walfd != -1 && fsync(walfd) == -1) {
+		syslog(LOG_ERR, "WAL fsync failed: %m");
+		return;
+	}
+	if (wal_logfd == -1 || (walfd != -1 && wal_catchup() == -1))
+		return;
+	if (wal_write(wal_logfd, group, group_len, &group_done) == -1) {
+		syslog(LOG_ERR, "Log write failed: %m");
+		return;
+	}
+	group_len = group_done = 0;
+	wal_applied = wal_seq;
+	if (wal_size >= WAL_CHECKPOINT)
+		wal_checkpoint();
+}
+
+/*
+ * Log a cycle's readings.
+ */
+void
+wal_append(const char *buf, size_t len)
+{
+	struct wal_record	 rec;
+	struct iovec		 iov[2];
+	char			*new;
+	size_t			 max;
+
+	if (len == 0)
+		return;
+	if (group_len + len > group_max) {
+		/* Grow geometrically so steady state does not allocate. */
+		for (max = group_max ? group_max : WAL_GROUP;
+		    max < group_len + len;)
+			max *= 2;
+		if ((new = realloc(group, max)) == NULL) {
+			syslog(LOG_ERR, "Out of memory, readings lost");
+			return;
+		}
+		group = new;
+		group_max = max;
+	}
+	memcpy(group + group_len, buf, len);
+	if (group_len == 0) {
+		group_start = wal_now();
+		group_walled = 1;
+	}
+	group_len += len;
+
+	if (walfd == -1 || len > WAL_MAXREC)
+		group_walled = 0;
+	else {
+		memset(&rec, '\0', sizeof(rec));
+		rec.magic = WAL_RECMAGIC;
+		rec.len = len;
+		rec.seq = ++wal_seq;
+		rec.crc = wal_reccrc(&rec, buf);
+		iov[0].iov_base = &rec;
+		iov[0].iov_len = sizeof(rec);
+		iov[1].iov_base = (void *)buf;
+		iov[1].iov_len = len;
+		if (pwritev(walfd, iov, 2, wal_size) == sizeof(rec) + len)
+			wal_size += sizeof(rec) + len;
+		else {
+			syslog(LOG_ERR, "WAL write failed: %m");
+			group_walled = 0;
+		}
+	}
+
+	if (wal_now() - group_start >= wal_interval)
+		wal_commit();
+}
@@ -40,19 +40,19 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <syslog.h>
 #include <time.h>
+#include <termios.h>
 #include <unistd.h>
 
 #include "ekmprivate.h"
 #include "ekm.h"
 
-char *strdecpy(char *, const char *, size_t, size_t);
-
 uint16_t
 ekmcrc(const void const *dat, uint16_t len)
 {
@@ -69,21 +69,250 @@ ekmcrc(const void const *dat, uint16_t len)
 }
 
 /*
- * Copy a numeric string inserting a '.' at dst[dec]
+ * Append the CRC to a len byte command frame in buf.  The CRC covers
+ * everything after the leading SOH.  Returns the length of the frame.
+ */
+int
+ekm_seal(char *buf, int len)
+{
+	u_int16_t	 crc;
+
+	crc = htons(ekmcrc(buf + 1, len - 1));
+	memcpy(buf + len, &crc, sizeof(crc));
+
+	return(len + sizeof(crc));
+}
+
+/*
+ * Convert len ASCII digits.
+ */
+static int
+ekm_digits(const char *src, int len)
+{
+	int	 val;
+
+	for (val = 0; len--; src++)
+		val = val * 10 + (*src - '0');
+
+	return(val);
+}
+
+/*
+ * Local time offsets are cached per year as a list of intervals with a
+ * constant UTC offset.  Meter years are two digits, so 100 entries cover
+ * every date a meter can report.
+ */
+#define	TZ_INTERVALS	16
+
+struct tz_interval {
+	time_t	 start;
+	long	 stdoff;
+	int	 uselibc;
+};
+
+static struct tz_year {
+	int			 valid;
+	int			 n;
+	time_t			 end;
+	struct tz_interval	 interval[TZ_INTERVALS];
+} tz_cache[100];
+
+/*
+ * Days since 1970-01-01 of a proleptic Gregorian date.
+ */
+static long
+ekm_days(int year, int mon, int mday)
+{
+	long	 era, yoe, doy;
+
+	year -= mon <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + mday - 1;
+
+	return(era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468);
+}
+
+/*
+ * Find the UTC offset changes from the middle of the year before to the
+ * middle of the year after by sampling daily and bisecting to the second.
+ *
+ * The meter clock is read as standard time, as mktime() does with
+ * tm_isdst = 0, so a daylight saving interval takes the offset of the
+ * standard time around it.  Where that is not the same on both sides the
+ * libc implementations disagree on which to use, so those intervals are
+ * left to mktime().
  */
-char *
-strdecpy(char *dst, const char *src, size_t len, size_t dec)
+static void
+tz_load(struct tz_year *tzy, int year)
 {
-	int	d, s;
+	struct tm	 tm;
+	time_t		 t, lo, hi, mid, start;
+	long		 off[TZ_INTERVALS], prev;
+	int		 dst[TZ_INTERVALS], i, j, k;
+
+	start = ekm_days(year - 1, 7, 1) * 86400;
+	tzy->end = ekm_days(year + 1, 7, 1) * 86400;
+	localtime_r(&start, &tm);
+	tzy->n = 1;
+	tzy->interval[0].start = start;
+	off[0] = prev = tm.tm_gmtoff;
+	dst[0] = tm.tm_isdst > 0;
+	for (t = start + 86400; t < tzy->end; t += 86400) {
+		localtime_r(&t, &tm);
+		if (tm.tm_gmtoff == prev &&
+		    (tm.tm_isdst > 0) == dst[tzy->n - 1])
+			continue;
+		if (tzy->n == TZ_INTERVALS) {
+			tzy->end = t - 86400;
+			break;
+		}
+		for (lo = t - 86400, hi = t; hi - lo > 1;) {
+			mid = lo + (hi - lo) / 2;
+			localtime_r(&mid, &tm);
+			if (tm.tm_gmtoff == prev &&
+			    (tm.tm_isdst > 0) == dst[tzy->n - 1])
+				lo = mid;
+			else
+				hi = mid;
+		}
+		localtime_r(&hi, &tm);
+		tzy->interval[tzy->n].start = hi;
+		off[tzy->n] = prev = tm.tm_gmtoff;
+		dst[tzy->n] = tm.tm_isdst > 0;
+		tzy->n++;
+	}
+
+	for (i = 0; i < tzy->n; i++) {
+		tzy->interval[i].stdoff = off[i];
+		tzy->interval[i].uselibc = 0;
+		if (!dst[i])
+			continue;
+		for (j = i - 1; j >= 0 && dst[j]; j--)
+			;
+		for (k = i + 1; k < tzy->n && dst[k]; k++)
+			;
+		if (j < 0 || k == tzy->n || off[j] != off[k])
+			tzy->interval[i].uselibc = 1;
+		else
+			tzy->interval[i].stdoff = off[j];
+	}
+	tzy->valid = 1;
+}
+
+/*
+ * Convert the meter's YYMMDDWWHHMMSS date to a time_t.  The result is the
+ * same as strptime() and mktime() with tm_isdst = 0, but once the year is
+ * cached the time zone code is only used for dates it can't resolve
+ * unambiguously, such as those repeated when the standard offset changes.
+ * A date that is not all digits converts to -1.
+ */
+time_t
+ekm_time(const char *date)
+{
+	struct tz_year		*tzy;
+	struct tz_interval	*tzi;
+	struct tm		 tm;
+	time_t			 local, t, end, found;
+	int			 i, yy, year, matches;
+
+	for (i = 0; i < 14; i++)
+		if (date[i] < '0' || date[i] > '9')
+			return(-1);
+	yy = ekm_digits(date, 2);
+	year = yy < 69 ? 2000 + yy : 1900 + yy;
+	local = ekm_days(year, ekm_digits(date + 2, 2),
+	    ekm_digits(date + 4, 2)) * 86400 + ekm_digits(date + 8, 2) * 3600 +
+	    ekm_digits(date + 10, 2) * 60 + ekm_digits(date + 12, 2);
+
+	tzy = &tz_cache[yy];
+	if (!tzy->valid)
+		tz_load(tzy, year);
+	for (found = 0, matches = 0, i = 0; i < tzy->n; i++) {
+		tzi = &tzy->interval[i];
+		end = i + 1 < tzy->n ? tzy->interval[i + 1].start : tzy->end;
+		t = local - tzi->stdoff;
+		if (t < tzi->start || t >= end)
+			continue;
+		if (tzi->uselibc) {
+			matches = 0;
+			break;
+		}
+		found = t;
+		matches++;
+	}
+	if (matches == 1)
+		return(found);
+
+	memset(&tm, '\0', sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mon = ekm_digits(date + 2, 2) - 1;
+	tm.tm_mday = ekm_digits(date + 4, 2);
+	tm.tm_hour = ekm_digits(date + 8, 2);
+	tm.tm_min = ekm_digits(date + 10, 2);
+	tm.tm_sec = ekm_digits(date + 12, 2);
+	return(mktime(&tm));
+}
 
-	for(s = 0, d = 0; s < len; s++, d++) {
-		if (dec > 0 && s == dec)
-			dst[d++] = '.';
-		dst[d] = src[s];
+/*
+ * Connect to an RS485 bus.  The bus is either a serial device or the
+ * host:port of a TCP to RS485 interface such as the EKM iSerial.  The
+ * connection is non-blocking.
+ */
+int
+ekm_connect(const char *bus)
+{
+	struct addrinfo	 hints, *res, *ai;
+	struct termios	 tios;
+	const char	*port;
+	char		 host[256];
+	int		 con;
+
+	if (*bus != '/' && (port = strrchr(bus, ':')) != NULL) {
+		snprintf(host, sizeof(host), "%.*s", (int)(port - bus), bus);
+		memset(&hints, '\0', sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host, port + 1, &hints, &res) != 0)
+			return(-1);
+		for (con = -1, ai = res; ai != NULL && con == -1;
+		    ai = ai->ai_next) {
+			con = socket(ai->ai_family, ai->ai_socktype,
+			    ai->ai_protocol);
+			if (con != -1 &&
+			    connect(con, ai->ai_addr, ai->ai_addrlen) == -1) {
+				close(con);
+				con = -1;
+			}
+		}
+		freeaddrinfo(res);
+		if (con == -1)
+			return(-1);
+	} else {
+		if ((con = open(bus, O_RDWR | O_NOCTTY | O_EXCL)) == -1)
+			return(-1);
+		memset(&tios, '\0', sizeof(struct termios));
+		cfsetispeed(&tios, B9600);
+		cfsetospeed(&tios, B9600);
+		tios.c_cflag |= (CREAD | CLOCAL);
+		tios.c_cflag &= ~CSIZE;
+		tios.c_cflag |= CS7;	/* 7 Bits */
+		tios.c_cflag &= ~CSTOPB; /* 1 Stop Bit */
+		tios.c_cflag |= PARENB; /* Even Parity */
+		tios.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+		tios.c_iflag &= INPCK | ISTRIP;
+		tios.c_iflag &= ~(IXON | IXOFF | IXANY);
+		tios.c_oflag &= ~OPOST;	/* Raw ouput */
+		tios.c_cc[VMIN] = 1;
+		tios.c_cc[VTIME] = 1;
+		if (tcsetattr(con, TCSANOW, &tios) < 0) {
+			close(con);
+			return(-1);
+		}
 	}
-	dst[d] = '\0';
+	fcntl(con, F_SETFL, O_NONBLOCK);
 
-	return(dst);
+	return(con);
 }
 
 void
@@ -147,18 +376,93 @@ read_response(int connection, void *buffer, size_t nbytes)
 	return(crc == ntohs(*(u_int16_t *)&((char*)buffer)[got -sizeof(crc)]));
 }
 
-void
-ekm_tou_cvt(struct _tou_meter *in, struct meter_tou *out)
+/*
+ * Field decoders for the F() lists in ekmprivate.h.  Each expands to
+ * straight line arithmetic on a fixed width field; reply and response
+ * name the frame and the structure being filled.
+ */
+static const double ekm_scale[4] = { 1, 10, 100, 1000 };
+
+#define	EKM_F_INT(f, s)		ekm_digits((f), sizeof(f))
+#define	EKM_F_FIXED(f, s)	(ekm_digits((f), sizeof(f)) / ekm_scale[s])
+#define	EKM_F_PF(f, s)							\
+	((1 - 2 * ((f)[0] == 'C')) * ekm_digits((f) + 1, sizeof(f) - 1) / 100.0)
+#define	EKM_F_CHAR(f, s)	(f)
+#define	EKM_F_TIME(f, s)	ekm_time(f)
+
+#define	EKM_DECODE(kind, field, scale, member)				\
+	response->member = EKM_F_##kind(reply->field, scale);
+
+static void
+ekm_decode_tou(const struct _tou_meter *reply, struct meter_tou *response)
+{
+	EKM_TOU_FIELDS(EKM_DECODE)
+}
+
+/*
+ * Meters report the sum of both directions; keep the net forward reading.
+ */
+static void
+ekm_net(struct meter_tou *forward, const struct meter_tou *reverse)
 {
-	char	 buffer[260];
 	int	 i;
 
-	strdecpy(buffer, in->total_kwh, 8, 7);
-	sscanf(buffer, "%lf", &out->total);
-	for (i = 0; i < 4; i++) {
-		strdecpy(buffer, in->tou[i], 8, 7);
-		sscanf(buffer, "%lf", &out->tou[i]);
-	}
+	forward->total -= reverse->total;
+	for (i = 0; i < 4; i++)
+		forward->tou[i] -= reverse->tou[i];
+}
+
+static void
+ekm_decode_v3(const struct _ekmv3reply *reply, struct meter_response *response)
+{
+	EKM_V3_FIELDS(EKM_DECODE)
+	ekm_decode_tou(&reply->total, &response->forward);
+	ekm_decode_tou(&reply->reverse, &response->reverse);
+	ekm_net(&response->forward, &response->reverse);
+}
+
+/*
+ * kwh_scale is '0', '1' or '2' for 0, 1 or 2 decimal places.
+ */
+static int
+ekm_decode_v4a(const struct _ekmv4replya *reply,
+    struct meter_response *response)
+{
+	EKM_V4A_FIELDS(EKM_DECODE, reply->kwh_scale & 3)
+	return(reply->kwh_scale & 3);
+}
+
+static void
+ekm_decode_v4b(const struct _ekmv4replyb *reply,
+    struct meter_response *response, int kwh_scale)
+{
+	EKM_V4B_FIELDS(EKM_DECODE, kwh_scale)
+}
+
+/*
+ * Build the frames used to open a meter.  Any meter left open on the bus
+ * is closed in the same write.
+ */
+void
+meter_handle_init(struct meter_handle *handle, u_int64_t meter)
+{
+	size_t	 len;
+
+	handle->address = meter;
+	len = strlen(EKM_METER_CLOSE);
+	memcpy(handle->open_frame, EKM_METER_CLOSE, len);
+	len += snprintf(handle->open_frame + len,
+	    sizeof(handle->open_frame) - len, EKM_METER_OPEN, meter);
+	handle->open_len = len;
+}
+
+int
+meter_open(int connection, struct meter_response *response, u_int64_t meter)
+{
+	struct meter_handle	 handle;
+
+	meter_handle_init(&handle, meter);
+	return(meter_open_handle(connection, response, &handle));
 }
 
 /*
@@ -168,65 +472,63 @@ ekm_tou_cvt(struct _tou_meter *in, struct meter_tou *out)
  *     UART data stuck in the read buffer on the remote end.
  */
 int
-meter_open(int connection, struct meter_response *response, u_int64_t meter)
+meter_open_handle(int connection, struct meter_response *response,
+    const struct meter_handle *handle)
 {
-	struct tm		 tm;
 	struct _ekmv3reply	 reply;
-	char			 buffer[260];
-	int			 i, len, result;
+	int			 result;
 
 	ekm_flush(connection);
-	write(connection, EKM_METER_CLOSE, strlen(EKM_METER_CLOSE));
-	len = sprintf(buffer, EKM_METER_OPEN, meter);
-	write(connection, buffer, len);
+	write(connection, handle->open_frame, handle->open_len);
 	result = read_response(connection, &reply, 255);
 	if (result < 1) {
 		ekm_flush(connection);
 		return(result);
 	}
 
-	response->address = meter;
-	response->firmware = reply.firmware;
-	ekm_tou_cvt(&reply.total, &response->forward);
-	ekm_tou_cvt(&reply.reverse, &response->reverse);
-	response->forward.total -= response->reverse.total;
-	for(i = 0; i < 4; i++)
-		response->forward.tou[i] -= response->reverse.tou[i];
-
-	strdecpy(buffer, reply.total_power, 7, 0);
-	sscanf(buffer, "%d", &response->total_power);
-
-	for(i = 0; i < 3; i++) {
-		strdecpy(buffer, reply.volts[i], 4, 3);
-		sscanf(buffer, "%lf", &response->volts[i]);
-		strdecpy(buffer, reply.amps[i], 5, 4);
-		sscanf(buffer, "%lf", &response->amps[i]);
-		strdecpy(buffer, reply.power[i], 7, 0);
-		sscanf(buffer, "%d", &response->power[i]);
-		strdecpy(buffer, reply.pf[i], 4, 2);
-		sscanf(buffer + 1, "%lf", &response->pf[i]);
-		if (*buffer == 'C')
-			response->pf[i] *= -1;
-		strdecpy(buffer, reply.pulse[i], 8, 0);
-		sscanf(buffer, "%llu", &response->pulse[i]);
-		strdecpy(buffer, reply.pulseratio[i], 8, 0);
-		sscanf(buffer, "%d", &response->pulseratio[i]);
-		response->pulsetrigger[i] = reply.pulse_h_l[i];
-	}
-
-	strdecpy(buffer, reply.max_demand, 7, 0);
-	sscanf(buffer, "%llu", &response->max_demand);
+	response->address = handle->address;
+	ekm_decode_v3(&reply, response);
 
-	response->demand_period = reply.demand_period;
+	return(result);
+}
 
-	strdecpy(buffer, reply.date, 14, 0);
-	buffer[7] = '0'; /* Date doesn't conform to ISO/IEC 9899:1990 */
-	memset(&tm, '\0', sizeof(tm));
-	strptime(buffer, "%y%m%d00%H%M%S", &tm);
-	response->time = mktime(&tm);
+/*
+ * Open a v4 meter with request A and then request B.  The ToU registers
+ * and the settings that v3 meters return are only in the B reply.
+ */
+int
+meter_open_v4(int connection, struct meter_response *response,
+    u_int64_t meter)
+{
+	struct _ekmv4replya	 reply_a;
+	struct _ekmv4replyb	 reply_b;
+	char			 frame[32];
+	size_t			 len;
+	int			 result, kwh_scale;
+
+	len = strlen(EKM_METER_CLOSE);
+	memcpy(frame, EKM_METER_CLOSE, len);
+	len += snprintf(frame + len, sizeof(frame) - len, EKM_METER_OPEN_A,
+	    meter);
+	ekm_flush(connection);
+	write(connection, frame, len);
+	if ((result = read_response(connection, &reply_a,
+	    sizeof(reply_a))) != 1) {
+		ekm_flush(connection);
+		return(result);
+	}
+	len = snprintf(frame, sizeof(frame), EKM_METER_OPEN_B, meter);
+	write(connection, frame, len);
+	if ((result = read_response(connection, &reply_b,
+	    sizeof(reply_b))) != 1) {
+		ekm_flush(connection);
+		return(result);
+	}
 
-	strdecpy(buffer, reply.ct_size, 4, 0);
-	response->ct_size = atoi(buffer);
+	response->address = meter;
+	kwh_scale = ekm_decode_v4a(&reply_a, response);
+	ekm_decode_v4b(&reply_b, response, kwh_scale);
+	ekm_net(&response->forward, &response->reverse);
 
 	return(result);
 }
@@ -234,14 +536,11 @@ meter_open(int connection, struct meter_response *response, u_int64_t meter)
 int
 meter_login(int connection, char *password)
 {
-	u_int16_t	 crc;
 	char		 buffer[260];
 	int		 len, result;
 
-	len = sprintf(buffer, EKM_PASSWORD, password);
-	crc = ekmcrc(buffer + 1, len - 1);
-	*(u_int16_t *)(buffer+len) = htons(crc);
-	write(connection, buffer, len+2);
+	len = ekm_seal(buffer, sprintf(buffer, EKM_PASSWORD, password));
+	write(connection, buffer, len);
 	if ((result = ekm_read(connection, buffer, 1)) < 0)
 		return(result);
 	return(*buffer == '\x06');
@@ -259,61 +558,263 @@ meter_close(int connection)
 int
 readhistory(int con, struct meter_history *history)
 {
+	static char	 total[16], rev[16];
+	static int	 total_len, rev_len;
 	struct _ekm_meter_history	 history_total;
 	struct _ekm_meter_history	 history_rev;
-	char		 buffer[255];
-	u_int16_t	 crc;
-	int		 len, result, i, j;
+	int		 result, i;
 
-	strcpy(buffer, EKM_6MONTH_TOTAL);
-	len = strlen(buffer);
-	crc = ekmcrc(buffer + 1, len - 1);
-	*(u_int16_t *)(buffer+len) = htons(crc);
-	write(con, buffer, len+2);
+	if (total_len == 0) {
+		total_len = ekm_seal(strcpy(total, EKM_6MONTH_TOTAL),
+		    strlen(EKM_6MONTH_TOTAL));
+		rev_len = ekm_seal(strcpy(rev, EKM_6MONTH_REV),
+		    strlen(EKM_6MONTH_REV));
+	}
+
+	write(con, total, total_len);
 	if ((result = read_response(con, &history_total, 255)) != 1)
 		return(result);
-	strcpy(buffer, EKM_6MONTH_REV);
-	len = strlen(buffer);
-	crc = ekmcrc(buffer + 1, len - 1);
-	*(u_int16_t *)(buffer+len) = htons(crc);
-	write(con, buffer, len+2);
+	write(con, rev, rev_len);
 	if ((result = read_response(con, &history_rev, 255)) != 1)
 		return(result);
 
 	for (i = 0; i < 6; i++) {
-		ekm_tou_cvt(&history_total.month[i], &history->forward[i]);
-		ekm_tou_cvt(&history_rev.month[i], &history->reverse[i]);
-		history->forward[i].total -= history->reverse[i].total;
-		for (j = 0; j < 4; j++)
-			history->forward[i].tou[j]-=history->reverse[i].tou[j];
-			
+		ekm_decode_tou(&history_total.month[i], &history->forward[i]);
+		ekm_decode_tou(&history_rev.month[i], &history->reverse[i]);
+		ekm_net(&history->forward[i], &history->reverse[i]);
 	}
 	return (1);
 }
 
+static void
+ekm_decode_period(const struct _ekm_schedule_entry *reply,
+    struct meter_period *response)
+{
+	EKM_PERIOD_FIELDS(EKM_DECODE)
+}
+
+static void
+ekm_decode_season(const struct _ekm_season_entry *reply,
+    struct meter_season *response)
+{
+	EKM_SEASON_FIELDS(EKM_DECODE)
+}
+
+static void
+ekm_decode_holiday(const struct _ekm_holiday *reply,
+    struct meter_holiday *response)
+{
+	EKM_HOLIDAY_FIELDS(EKM_DECODE)
+}
+
+static void
+ekm_decode_holidays(const struct _ekm_meter_holidays *reply,
+    struct meter_schedule *response)
+{
+	int	 i;
+
+	for (i = 0; i < EKM_HOLIDAYS; i++)
+		ekm_decode_holiday(&reply->holidays[i], &response->holiday[i]);
+	EKM_HOLIDAYS_FIELDS(EKM_DECODE)
+}
+
+/*
+ * Read the TOU period tables, seasons and holidays.
+ */
 int
 scheduleread(int con, struct meter_schedule *sched)
 {
-	char		 buffer[255];
-	u_int16_t	 crc;
-	int		 len;
+	static const char * const cmds[3] = {
+	    EKM_SCHEDULE1, EKM_SCHEDULE2, EKM_SCHEDULE_HOLIDAY };
+	static char	 frames[3][16];
+	static int	 lens[3];
+	struct period_table		 periods[2];
+	struct _ekm_meter_holidays	 holidays;
+	void				*replies[3];
+	int				 i, j, k, result;
+
+	replies[0] = &periods[0];
+	replies[1] = &periods[1];
+	replies[2] = &holidays;
+	for (i = 0; i < 3; i++) {
+		if (lens[i] == 0)
+			lens[i] = ekm_seal(strcpy(frames[i], cmds[i]),
+			    strlen(cmds[i]));
+		write(con, frames[i], lens[i]);
+		if ((result = read_response(con, replies[i], 255)) != 1)
+			return(result);
+	}
 
-	strcpy(buffer, EKM_SCHEDULE2);
-	len = strlen(buffer);
-	crc = ekmcrc(buffer + 1, len - 1);
-	*(u_int16_t *)(buffer+len) = htons(crc);
-	write(con, buffer, len+2);
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < 4; j++)
+			for (k = 0; k < EKM_PERIODS; k++)
+				ekm_decode_period(
+				    &periods[i].schedule[j].table[k],
+				    &sched->schedule[i * 4 + j][k]);
+	for (i = 0; i < EKM_SEASONS; i++)
+		ekm_decode_season(&periods[1].season.table[i],
+		    &sched->season[i]);
+	ekm_decode_holidays(&holidays, sched);
+	sched->crc[0] = periods[0].crc;
+	sched->crc[1] = periods[1].crc;
+	sched->crc[2] = holidays.crc;
 
-	read_response(con, buffer, 255);
-	write(1, buffer, 255);
 	return(1);
 }
 
+/*
+ * Fill the rate for every minute of a schedule.  Each period runs until
+ * the next one starts and the last period of the day carries on past
+ * midnight.  A schedule with no periods bills everything to rate 1, as
+ * an unprogrammed meter does.
+ */
+static void
+tariff_schedule(u_int8_t *rate, const struct meter_schedule *sched, int s)
+{
+	int	 i, last, minute, start[EKM_PERIODS];
+
+	for (last = 1, i = 0; i < EKM_PERIODS; i++) {
+		start[i] = -1;
+		if (sched->schedule[s][i].rate == 0 ||
+		    sched->schedule[s][i].hour > 23 ||
+		    sched->schedule[s][i].min > 59)
+			continue;
+		start[i] = sched->schedule[s][i].hour * 60 +
+		    sched->schedule[s][i].min;
+	}
+	/* The rate in force at midnight is that of the latest period. */
+	for (minute = -1, i = 0; i < EKM_PERIODS; i++)
+		if (start[i] > minute) {
+			minute = start[i];
+			last = sched->schedule[s][i].rate;
+		}
+	for (minute = 0; minute < 24 * 60; minute++) {
+		for (i = 0; i < EKM_PERIODS; i++)
+			if (start[i] == minute)
+				last = sched->schedule[s][i].rate;
+		rate[minute] = last;
+	}
+}
+
+/*
+ * Schedules are numbered from 1 by the meter; out of range numbers fall
+ * back to the first schedule.
+ */
+static u_int8_t
+tariff_index(int schedule)
+{
+	if (schedule < 1 || schedule > EKM_SCHEDULES)
+		return(0);
+	return(schedule - 1);
+}
+
+void
+meter_tariff_init(struct meter_tariff *tariff,
+    const struct meter_schedule *sched)
+{
+	u_int8_t	 current;
+	int		 i, mon, mday, date, start, latest;
+
+	tariff->cache_start = tariff->cache_end = 0;
+	for (i = 0; i < EKM_SCHEDULES; i++)
+		tariff_schedule(tariff->rate[i], sched, i);
+
+	/*
+	 * Each season runs until the next one starts, wrapping round the
+	 * end of the year like the periods of a day.
+	 */
+	current = 0;
+	for (latest = -1, i = 0; i < EKM_SEASONS; i++) {
+		if (sched->season[i].schedule == 0)
+			continue;
+		start = sched->season[i].month * 100 + sched->season[i].day;
+		if (start > latest) {
+			latest = start;
+			current = tariff_index(sched->season[i].schedule);
+		}
+	}
+	for (mon = 0; mon < 12; mon++) {
+		for (mday = 0; mday < 31; mday++) {
+			date = (mon + 1) * 100 + mday + 1;
+			for (i = 0; i < EKM_SEASONS; i++)
+				if (sched->season[i].schedule != 0 &&
+				    sched->season[i].month * 100 +
+				    sched->season[i].day == date)
+					current = tariff_index(
+					    sched->season[i].schedule);
+			tariff->day[mon][mday][0] = current;
+			tariff->day[mon][mday][1] =
+			    sched->weekend_schedule ?
+			    tariff_index(sched->weekend_schedule) : current;
+		}
+	}
+
+	if (sched->holiday_schedule == 0)
+		return;
+	for (i = 0; i < EKM_HOLIDAYS; i++) {
+		mon = sched->holiday[i].month;
+		mday = sched->holiday[i].day;
+		if (mon < 1 || mon > 12 || mday < 1 || mday > 31)
+			continue;
+		tariff->day[mon - 1][mday - 1][0] =
+		    tariff->day[mon - 1][mday - 1][1] =
+		    tariff_index(sched->holiday_schedule);
+	}
+}
+
+/*
+ * Return the TOU rate in force at the given local time.  The arguments
+ * follow struct tm: mon 0-11, mday 1-31, wday 0-6 with Sunday as 0.
+ */
+static const u_int8_t	 tariff_weekend[7] = { 1, 0, 0, 0, 0, 0, 1 };
+
+int
+meter_tariff_rate(const struct meter_tariff *tariff, int mon, int mday,
+    int wday, int hour, int min)
+{
+	return(tariff->rate[tariff->day[mon][mday - 1][tariff_weekend[wday]]]
+	    [hour * 60 + min]);
+}
+
+/*
+ * Return the TOU rate in force at t.  The local hour t falls in is
+ * cached, so readings in time order cost three localtime_r() calls an
+ * hour.  An hour in which the UTC offset changes is cached a minute at a
+ * time.
+ */
+int
+meter_tariff_rate_time(struct meter_tariff *tariff, time_t t)
+{
+	struct tm	 tm, first, last;
+	time_t		 start, end;
+
+	if (t < tariff->cache_start || t >= tariff->cache_end) {
+		localtime_r(&t, &tm);
+		start = t - tm.tm_min * 60 - tm.tm_sec;
+		end = start + 3600 - 1;
+		localtime_r(&start, &first);
+		localtime_r(&end, &last);
+		if (first.tm_gmtoff == tm.tm_gmtoff &&
+		    last.tm_gmtoff == tm.tm_gmtoff) {
+			tariff->cache_start = start;
+			tariff->cache_end = start + 3600;
+			tariff->cache_minute = tm.tm_hour * 60;
+		} else {
+			tariff->cache_start = t - tm.tm_sec;
+			tariff->cache_end = tariff->cache_start + 60;
+			tariff->cache_minute = tm.tm_hour * 60 + tm.tm_min;
+		}
+		tariff->cache_schedule = tariff->day[tm.tm_mon][tm.tm_mday - 1]
+		    [tariff_weekend[tm.tm_wday]];
+	}
+	return(tariff->rate[tariff->cache_schedule][tariff->cache_minute +
+	    (t - tariff->cache_start) / 60]);
+}
+
 int
 set_time(int con)
 {
 	char		 buffer[255];
-	u_int16_t	 crc;
 	int		 len;
 	struct tm	*tv;
 	time_t		 clock;
@@ -322,9 +823,8 @@ set_time(int con)
 	tv = localtime(&clock);
 	len = sprintf(buffer, EKM_TIME, tv->tm_year - 100,tv->tm_mon + 1,
 	    tv->tm_mday, tv->tm_wday + 1, tv->tm_hour, tv->tm_min, tv->tm_sec);
-	crc = ekmcrc(buffer + 1, len - 1);
-	*(u_int16_t *)(buffer+len) = htons(crc);
-	write(con, buffer, len+2);
+	len = ekm_seal(buffer, len);
+	write(con, buffer, len);
 	ekm_read(con, buffer, 1);
 
 	return(*buffer == '\x06');
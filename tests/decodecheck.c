@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * Check the generated v3 decoder against the strdecpy() and sscanf()
+ * decoder it replaced.
+ *
+ *	decodecheck
+ *
+ * Random CRC-valid v3 replies are served to meter_open() over a socket
+ * pair and every field is compared with the old conversion.  The old
+ * decoder read pulseratio 8 digits wide, running into the next field;
+ * the reference here reads the 4 digits in the layout, which is what the
+ * generated decoder is meant to do.  Any difference is reported and makes
+ * the exit status 1.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../ekmprivate.h"
+#include "../ekm.h"
+
+#define	FRAMES		2000
+
+static void
+digits(char *dst, size_t len)
+{
+	while (len--)
+		*dst++ = '0' + rand() % 10;
+}
+
+static void
+random_reply(struct _ekmv3reply *reply)
+{
+	char	 date[32];
+	int	 i;
+
+	digits((char *)reply, sizeof(*reply));
+	reply->start = '\x02';
+	reply->firmware = 'a' + rand() % 26;
+	reply->demand_period = '1' + rand() % 3;
+	for (i = 0; i < 3; i++) {
+		reply->pf[i][0] = rand() % 2 ? 'C' : 'L';
+		reply->pulse_h_l[i] = rand() % 2 ? '0' : '1';
+	}
+	snprintf(date, sizeof(date), "%02d%02d%02d%02d%02d%02d%02d",
+	    rand() % 100, 1 + rand() % 12, 1 + rand() % 28, 1 + rand() % 7,
+	    rand() % 24, rand() % 60, rand() % 60);
+	memcpy(reply->date, date, sizeof(reply->date));
+	reply->crc = htons(ekmcrc((char *)reply + 1, sizeof(*reply) - 3));
+}
+
+/*
+ * The old decoder: copy the digits with a '.' inserted and scan them.
+ */
+static char *
+strdecpy(char *dst, const char *src, size_t len, size_t dec)
+{
+	size_t	 d, s;
+
+	for (s = 0, d = 0; s < len; s++, d++) {
+		if (dec > 0 && s == dec)
+			dst[d++] = '.';
+		dst[d] = src[s];
+	}
+	dst[d] = '\0';
+
+	return(dst);
+}
+
+static void
+ref_tou(const struct _tou_meter *in, struct meter_tou *out)
+{
+	char	 buffer[16];
+	int	 i;
+
+	strdecpy(buffer, in->total_kwh, 8, 7);
+	sscanf(buffer, "%lf", &out->total);
+	for (i = 0; i < 4; i++) {
+		strdecpy(buffer, in->tou[i], 8, 7);
+		sscanf(buffer, "%lf", &out->tou[i]);
+	}
+}
+
+static void
+ref_decode(const struct _ekmv3reply *reply, struct meter_response *response)
+{
+	char	 buffer[16];
+	int	 i;
+
+	response->firmware = reply->firmware;
+	ref_tou(&reply->total, &response->forward);
+	ref_tou(&reply->reverse, &response->reverse);
+	response->forward.total -= response->reverse.total;
+	for (i = 0; i < 4; i++)
+		response->forward.tou[i] -= response->reverse.tou[i];
+
+	strdecpy(buffer, reply->total_power, 7, 0);
+	sscanf(buffer, "%d", &response->total_power);
+	for (i = 0; i < 3; i++) {
+		strdecpy(buffer, reply->volts[i], 4, 3);
+		sscanf(buffer, "%lf", &response->volts[i]);
+		strdecpy(buffer, reply->amps[i], 5, 4);
+		sscanf(buffer, "%lf", &response->amps[i]);
+		strdecpy(buffer, reply->power[i], 7, 0);
+		sscanf(buffer, "%d", &response->power[i]);
+		strdecpy(buffer, reply->pf[i], 4, 2);
+		sscanf(buffer + 1, "%lf", &response->pf[i]);
+		if (*buffer == 'C')
+			response->pf[i] *= -1;
+		strdecpy(buffer, reply->pulse[i], 8, 0);
+		sscanf(buffer, "%llu", (unsigned long long *)&response->pulse[i]);
+		strdecpy(buffer, reply->pulseratio[i], 4, 0);
+		sscanf(buffer, "%d", &response->pulseratio[i]);
+		response->pulsetrigger[i] = reply->pulse_h_l[i];
+	}
+	strdecpy(buffer, reply->max_demand, 7, 0);
+	sscanf(buffer, "%llu", (unsigned long long *)&response->max_demand);
+	response->demand_period = reply->demand_period;
+	response->time = ekm_time(reply->date);
+	strdecpy(buffer, reply->ct_size, 4, 0);
+	response->ct_size = atoi(buffer);
+}
+
+/*
+ * Answer each Open with the next reply.
+ */
+static void
+meter(int fd, const struct _ekmv3reply *replies)
+{
+	char	 buf[64];
+	size_t	 len;
+	ssize_t	 n;
+	int	 i;
+
+	for (i = 0; i < FRAMES; i++) {
+		for (len = 0; memchr(buf, '!', len) == NULL; len += n)
+			if ((n = read(fd, buf + len, sizeof(buf) - len)) <= 0)
+				exit(1);
+		write(fd, &replies[i], sizeof(replies[i]));
+	}
+	exit(0);
+}
+
+static int
+differs(int frame, const char *member)
+{
+	static int	 shown;
+
+	if (shown++ < 5)
+		printf("frame %d: %s differs\n", frame, member);
+	return(1);
+}
+
+#define	SAME(member)							\
+	(got.member == want.member ? 0 : differs(i, #member))
+
+int
+main(void)
+{
+	struct _ekmv3reply	*replies;
+	struct meter_response	 got, want;
+	int			 fd[2], i, j, bad, status;
+
+	if ((replies = calloc(FRAMES, sizeof(*replies))) == NULL) {
+		perror("decodecheck");
+		return(1);
+	}
+	srand(1);
+	for (i = 0; i < FRAMES; i++)
+		random_reply(&replies[i]);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == -1) {
+		perror("decodecheck");
+		return(1);
+	}
+	switch (fork()) {
+	    case -1:
+		perror("decodecheck");
+		return(1);
+	    case 0:
+		close(fd[0]);
+		meter(fd[1], replies);
+	}
+	close(fd[1]);
+	/* meter_open() drains stale input until a read would block. */
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+	for (bad = 0, i = 0; i < FRAMES; i++) {
+		memset(&got, '\0', sizeof(got));
+		memset(&want, '\0', sizeof(want));
+		if (meter_open(fd[0], &got, 300000001000ULL + i) != 1) {
+			printf("frame %d: meter_open failed\n", i);
+			bad++;
+			break;
+		}
+		ref_decode(&replies[i], &want);
+		bad += SAME(firmware) + SAME(forward.total) +
+		    SAME(reverse.total) + SAME(total_power) +
+		    SAME(max_demand) + SAME(demand_period) + SAME(time) +
+		    SAME(ct_size);
+		for (j = 0; j < 4; j++)
+			bad += SAME(forward.tou[j]) + SAME(reverse.tou[j]);
+		for (j = 0; j < 3; j++)
+			bad += SAME(volts[j]) + SAME(amps[j]) + SAME(power[j]) +
+			    SAME(pf[j]) + SAME(pulse[j]) + SAME(pulseratio[j]) +
+			    SAME(pulsetrigger[j]);
+	}
+	close(fd[0]);
+	wait(&status);
+	printf("%d/%d frames, %d differences\n", i, FRAMES, bad);
+
+	return(bad != 0);
+}
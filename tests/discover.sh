@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Sweep a fake bus with a few meters on it and check that discovery
+# leaves exactly those meters in the inventory, along with the one that
+# was already there.  The sweep is run with the meters answering at once
+# and again with them answering later than the first probe timeout.
+#
+# $Id$
+
+PORT=${PORT:-50986}
+FIRST=300000002000
+LAST=300000002040
+FOUND="300000002000 300000002007 300000002031 300000002040"
+KNOWN=300000009999
+
+dir=$(mktemp -d /tmp/ekmcheck.XXXXXX) || exit 1
+trap 'kill $bus 2>/dev/null; rm -rf $dir' EXIT
+
+for serial in $FOUND $KNOWN; do
+	echo $serial
+done | sort > $dir/want
+
+status=0
+for delay in 0 150; do
+	echo $KNOWN > $dir/meters
+	tests/fakebus -d $delay $PORT $FOUND &
+	bus=$!
+	sleep 1
+	./ekm -w $dir/ -d $FIRST-$LAST 127.0.0.1:$PORT > /dev/null
+	kill $bus
+	wait $bus 2>/dev/null
+	if sort $dir/meters | cmp -s - $dir/want; then
+		printf "%-34s ok\n" "reply delay $delay ms"
+	else
+		printf "%-34s FAILED\n" "reply delay $delay ms"
+		sort $dir/meters | diff $dir/want -
+		status=1
+	fi
+done
+exit $status
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * A TCP to RS485 interface with v3 meters behind it, for tests.
+ *
+ *	fakebus [-d delay] port [address ...]
+ *
+ * The meters at the addresses given, or at every address if none are,
+ * answer Open with a reply carrying the current time, in UTC, so the
+ * daemon under test should run with TZ=UTC.  Reads are answered with a
+ * frame of zeroes and password and time settings are acknowledged.  -d
+ * delays every reply to Open by delay milliseconds.  One connection is
+ * served at a time.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ekmprivate.h"
+#include "../ekm.h"
+
+static u_int64_t	*addresses;
+static int		 naddresses;
+static long		 delay;
+
+static int
+present(u_int64_t address)
+{
+	int	 i;
+
+	if (naddresses == 0)
+		return(1);
+	for (i = 0; i < naddresses; i++)
+		if (addresses[i] == address)
+			return(1);
+	return(0);
+}
+
+/*
+ * Open is "/?" and the 12 digit address.
+ */
+static void
+reply_open(int fd, const char *frame)
+{
+	struct _ekmv3reply	 reply;
+	struct tm		*tm;
+	time_t			 now;
+	char			 date[16];
+	u_int64_t		 address;
+	int			 i;
+
+	for (address = 0, i = 2; i < 14; i++) {
+		if (frame[i] < '0' || frame[i] > '9')
+			return;
+		address = address * 10 + frame[i] - '0';
+	}
+	if (!present(address))
+		return;
+	if (delay > 0)
+		usleep(delay * 1000);
+
+	memset(&reply, '0', sizeof(reply));
+	reply.start = '\x02';
+	memcpy(reply.address, frame + 2, sizeof(reply.address));
+	reply.firmware = '\x15';
+	reply.pf[0][0] = reply.pf[1][0] = reply.pf[2][0] = 'L';
+	now = time(NULL);
+	tm = gmtime(&now);
+	strftime(date, sizeof(date), "%y%m%d0%w%H%M%S", tm);
+	memcpy(reply.date, date, sizeof(reply.date));
+	reply.end = '\x03';
+	reply.crc = htons(ekmcrc((char *)&reply + 1,
+	    sizeof(reply) - sizeof(reply.crc) - 1));
+	write(fd, &reply, sizeof(reply));
+}
+
+static void
+reply_read(int fd)
+{
+	char		 frame[EKM_REPLY_LEN];
+	u_int16_t	 crc;
+
+	memset(frame, '0', sizeof(frame));
+	frame[0] = '\x02';
+	frame[sizeof(frame) - 3] = '\x03';
+	crc = htons(ekmcrc(frame + 1, sizeof(frame) - sizeof(crc) - 1));
+	memcpy(frame + sizeof(frame) - sizeof(crc), &crc, sizeof(crc));
+	write(fd, frame, sizeof(frame));
+}
+
+/*
+ * Answer every complete frame at the start of buf and return the number
+ * of bytes used.
+ */
+static size_t
+serve(int fd, const char *buf, size_t len)
+{
+	const char	*p, *end;
+	size_t		 used;
+
+	for (used = 0; used < len; used = end - buf) {
+		p = buf + used;
+		switch (*p) {
+		    case '/':
+			if ((end = memchr(p, '\n', len - used)) == NULL)
+				return(used);
+			end++;
+			if (end - p >= 14)
+				reply_open(fd, p);
+			break;
+		    case '\x01':
+			if ((end = memchr(p, '\x03', len - used)) == NULL)
+				return(used);
+			/* Close has one check byte, sealed frames two. */
+			end += p[1] == 'B' ? 2 : 3;
+			if (end > buf + len)
+				return(used);
+			if (p[1] == 'R')
+				reply_read(fd);
+			else if (p[1] != 'B')
+				write(fd, "\x06", 1);
+			break;
+		    default:
+			end = p + 1;
+			break;
+		}
+	}
+	return(used);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fakebus [-d delay] port [address ...]\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in	 sin;
+	char			 buf[1024];
+	size_t			 len;
+	ssize_t			 n;
+	int			 s, fd, on, ch, i;
+
+	while ((ch = getopt(argc, argv, "d:")) != -1) {
+		switch (ch) {
+		    case 'd':
+			delay = strtol(optarg, NULL, 10);
+			break;
+		    default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+	naddresses = argc - 1;
+	if ((addresses = calloc(argc, sizeof(*addresses))) == NULL) {
+		perror("fakebus");
+		exit(EX_OSERR);
+	}
+	for (i = 0; i < naddresses; i++)
+		addresses[i] = strtoull(argv[i + 1], NULL, 10);
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(atoi(argv[0]));
+	on = 1;
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(s, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(s, 1) == -1) {
+		perror("fakebus");
+		exit(EX_OSERR);
+	}
+	for (;;) {
+		if ((fd = accept(s, NULL, NULL)) == -1)
+			continue;
+		for (len = 0; (n = read(fd, buf + len, sizeof(buf) - len)) > 0;) {
+			len += n;
+			n = serve(fd, buf, len);
+			memmove(buf, buf + n, len - n);
+			len -= n;
+			if (len == sizeof(buf))
+				len = 0;
+		}
+		close(fd);
+	}
+}
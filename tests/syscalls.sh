@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Run the daemon against fakebus with syscount preloaded and fail if it
+# makes more than BUDGET system calls per meter per polling cycle.
+#
+# $Id$
+
+PORT=${PORT:-50985}
+METERS=${METERS:-4}
+BUDGET=${BUDGET:-8}
+
+dir=$(mktemp -d /tmp/ekmcheck.XXXXXX) || exit 1
+trap 'kill $bus 2>/dev/null; rm -rf $dir' EXIT
+
+tests/fakebus $PORT &
+bus=$!
+sleep 1
+
+i=0
+while [ $i -lt $METERS ]; do
+	echo $((300000001000 + i)) >> $dir/meters
+	i=$((i + 1))
+done
+
+TZ=UTC LD_PRELOAD=$(pwd)/tests/syscount.so EKM_METERS=$METERS \
+    EKM_BUDGET=$BUDGET ./ekm -b 127.0.0.1:$PORT -w $dir/
+status=$?
+[ $status -eq 0 ] || echo "syscall budget exceeded" >&2
+exit $status
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * Syscall budget check, preloaded into the daemon.
+ *
+ *	LD_PRELOAD=./syscount.so EKM_METERS=n EKM_BUDGET=calls ekm ...
+ *
+ * Counts the system calls the daemon makes itself.  Each poll timer event
+ * starts a cycle; after EKM_WARMUP cycles (default 3) the next EKM_CYCLES
+ * (default 5) are counted.  The counts are printed and the daemon exits 1
+ * if more than EKM_BUDGET (default 8) calls were made per meter per cycle
+ * or if it allocated memory during the counted cycles, else 0.
+ */
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+enum {
+	SC_READ, SC_WRITE, SC_PREAD, SC_PWRITE, SC_PWRITEV, SC_OPEN, SC_CLOSE,
+	SC_STAT, SC_FSTAT, SC_UNLINK, SC_RENAME, SC_FSYNC, SC_FTRUNCATE,
+	SC_LSEEK, SC_POLL, SC_KEVENT, SC_ACCEPT, SC_SOCKET, SC_COUNT
+};
+
+static const char * const sc_names[SC_COUNT] = {
+	"read", "write", "pread", "pwrite", "pwritev", "open", "close",
+	"stat", "fstat", "unlink", "rename", "fsync", "ftruncate",
+	"lseek", "poll", "kevent", "accept", "socket"
+};
+
+static unsigned long	 calls[SC_COUNT], start[SC_COUNT];
+static unsigned long	 allocs, allocstart;
+static int		 cycle;
+
+#define	REAL(name)							\
+	static __typeof__(name) *real;					\
+	if (real == NULL)						\
+		real = (__typeof__(name) *)dlsym(RTLD_NEXT, #name)
+
+static long
+env(const char *name, long def)
+{
+	char	*v;
+
+	return((v = getenv(name)) == NULL ? def : strtol(v, NULL, 10));
+}
+
+/*
+ * Called at the start of every cycle.
+ */
+static void
+sc_cycle(void)
+{
+	long		 warmup, cycles, meters, budget;
+	unsigned long	 total;
+	int		 i;
+
+	warmup = env("EKM_WARMUP", 3);
+	cycles = env("EKM_CYCLES", 5);
+	if (++cycle == warmup + 1) {
+		for (i = 0; i < SC_COUNT; i++)
+			start[i] = calls[i];
+		allocstart = allocs;
+	}
+	if (cycle != warmup + cycles + 1)
+		return;
+
+	meters = env("EKM_METERS", 1);
+	budget = env("EKM_BUDGET", 8);
+	for (total = 0, i = 0; i < SC_COUNT; i++) {
+		if (calls[i] == start[i])
+			continue;
+		fprintf(stderr, "%-10s %6.2f\n", sc_names[i],
+		    (double)(calls[i] - start[i]) / (cycles * meters));
+		total += calls[i] - start[i];
+	}
+	fprintf(stderr, "%-10s %6.2f per meter per cycle, budget %ld\n",
+	    "total", (double)total / (cycles * meters), budget);
+	if (allocs != allocstart)
+		fprintf(stderr, "%-10s %6.2f per meter per cycle, budget 0\n",
+		    "malloc", (double)(allocs - allocstart) / (cycles * meters));
+	_exit(total > budget * cycles * meters || allocs != allocstart);
+}
+
+/*
+ * The allocator is resolved before main() so that dlsym() allocating on
+ * its first call does not recurse; calls made while resolving fail.
+ */
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+
+static void __attribute__((constructor))
+sc_init(void)
+{
+	static int	 resolving;
+
+	if (resolving++)
+		return;
+	real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+	real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+}
+
+void *
+malloc(size_t len)
+{
+	if (real_malloc == NULL)
+		sc_init();
+	if (real_malloc == NULL)
+		return(NULL);
+	allocs++;
+	return(real_malloc(len));
+}
+
+void *
+calloc(size_t n, size_t len)
+{
+	if (real_calloc == NULL)
+		sc_init();
+	if (real_calloc == NULL)
+		return(NULL);
+	allocs++;
+	return(real_calloc(n, len));
+}
+
+void *
+realloc(void *p, size_t len)
+{
+	if (real_realloc == NULL)
+		sc_init();
+	if (real_realloc == NULL)
+		return(NULL);
+	allocs++;
+	return(real_realloc(p, len));
+}
+
+ssize_t
+read(int fd, void *buf, size_t len)
+{
+	REAL(read);
+	calls[SC_READ]++;
+	return(real(fd, buf, len));
+}
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+	REAL(write);
+	calls[SC_WRITE]++;
+	return(real(fd, buf, len));
+}
+
+ssize_t
+pread(int fd, void *buf, size_t len, off_t off)
+{
+	REAL(pread);
+	calls[SC_PREAD]++;
+	return(real(fd, buf, len, off));
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	REAL(pwrite);
+	calls[SC_PWRITE]++;
+	return(real(fd, buf, len, off));
+}
+
+ssize_t
+pwritev(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+	REAL(pwritev);
+	calls[SC_PWRITEV]++;
+	return(real(fd, iov, iovcnt, off));
+}
+
+int
+open(const char *path, int flags, ...)
+{
+	va_list	 ap;
+	int	 mode;
+
+	REAL(open);
+	va_start(ap, flags);
+	mode = flags & O_CREAT ? va_arg(ap, int) : 0;
+	va_end(ap);
+	calls[SC_OPEN]++;
+	return(real(path, flags, mode));
+}
+
+int
+close(int fd)
+{
+	REAL(close);
+	calls[SC_CLOSE]++;
+	return(real(fd));
+}
+
+int
+stat(const char *path, struct stat *sb)
+{
+	REAL(stat);
+	calls[SC_STAT]++;
+	return(real(path, sb));
+}
+
+int
+fstat(int fd, struct stat *sb)
+{
+	REAL(fstat);
+	calls[SC_FSTAT]++;
+	return(real(fd, sb));
+}
+
+int
+unlink(const char *path)
+{
+	REAL(unlink);
+	calls[SC_UNLINK]++;
+	return(real(path));
+}
+
+int
+rename(const char *from, const char *to)
+{
+	REAL(rename);
+	calls[SC_RENAME]++;
+	return(real(from, to));
+}
+
+int
+fsync(int fd)
+{
+	REAL(fsync);
+	calls[SC_FSYNC]++;
+	return(real(fd));
+}
+
+int
+ftruncate(int fd, off_t len)
+{
+	REAL(ftruncate);
+	calls[SC_FTRUNCATE]++;
+	return(real(fd, len));
+}
+
+off_t
+lseek(int fd, off_t off, int whence)
+{
+	REAL(lseek);
+	calls[SC_LSEEK]++;
+	return(real(fd, off, whence));
+}
+
+int
+poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	REAL(poll);
+	calls[SC_POLL]++;
+	return(real(fds, nfds, timeout));
+}
+
+int
+accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+{
+	REAL(accept);
+	calls[SC_ACCEPT]++;
+	return(real(s, addr, addrlen));
+}
+
+int
+socket(int domain, int type, int protocol)
+{
+	REAL(socket);
+	calls[SC_SOCKET]++;
+	return(real(domain, type, protocol));
+}
+
+int
+kevent(int kq, const struct kevent *changes, int nchanges,
+    struct kevent *events, int nevents, const struct timespec *timeout)
+{
+	int	 i, n;
+
+	REAL(kevent);
+	calls[SC_KEVENT]++;
+	n = real(kq, changes, nchanges, events, nevents, timeout);
+	for (i = 0; i < n; i++)
+		if (events[i].filter == EVFILT_TIMER && events[i].ident == 1)
+			sc_cycle();
+	return(n);
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * Check the TOU rate lookup against a known schedule.
+ *
+ *	tariffcheck [-b]
+ *
+ * Rates are checked at the boundaries that matter: seasons wrapping
+ * round the end of the year, holidays over weekends over seasons, the
+ * last period of the day carrying on past midnight and an empty schedule.
+ * meter_tariff_rate_time() is then compared with localtime_r() and
+ * meter_tariff_rate() for times in a set of zones, using tables that give
+ * nearly every minute and day a different value, walking forward and
+ * back a minute at a time around every UTC offset change from 2020 to
+ * 2030.  Any difference makes the exit status 1.  -b also times both
+ * lookups.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ekm.h"
+
+#define	TIMES		1000000
+
+struct rate_case {
+	const char	*name;
+	int		 mon, mday, wday, hour, min;
+	int		 rate;
+};
+
+/*
+ * Schedule 1 runs from March 1 and schedule 2 from November 1.  Weekends
+ * use schedule 3 and holidays schedule 4.
+ */
+static const struct rate_case cases[] = {
+	{ "season wraps into January",		0, 15, 3, 12, 0, 1 },
+	{ "wrapped season past midnight",	0, 15, 3, 5, 0, 4 },
+	{ "last day of the wrapped season",	1, 28, 2, 10, 0, 1 },
+	{ "first day of a season",		2, 1, 3, 10, 0, 2 },
+	{ "last day of a season",		9, 31, 1, 10, 0, 2 },
+	{ "season starts in November",		10, 1, 2, 10, 0, 1 },
+	{ "last period past midnight",		2, 1, 3, 0, 0, 3 },
+	{ "last period up to the first",	2, 1, 3, 6, 59, 3 },
+	{ "first period starts",		2, 1, 3, 7, 0, 2 },
+	{ "first period ends",			2, 1, 3, 21, 59, 2 },
+	{ "last period starts",			2, 1, 3, 22, 0, 3 },
+	{ "last period at 23:59",		2, 1, 3, 23, 59, 3 },
+	{ "weekend over season",		5, 6, 6, 10, 0, 2 },
+	{ "Sunday is a weekend day",		5, 7, 0, 3, 0, 2 },
+	{ "holiday over season",		6, 4, 3, 1, 0, 3 },
+	{ "holiday over weekend",		11, 25, 6, 10, 0, 3 },
+	{ "day after a holiday",		11, 26, 0, 10, 0, 2 },
+};
+
+static const char * const zones[] = {
+	"UTC", "America/New_York", "Europe/London", "Asia/Kolkata",
+	"Australia/Lord_Howe", "Pacific/Chatham", NULL
+};
+
+static void
+period(struct meter_schedule *sched, int s, int p, int hour, int min,
+    int rate)
+{
+	sched->schedule[s - 1][p].hour = hour;
+	sched->schedule[s - 1][p].min = min;
+	sched->schedule[s - 1][p].rate = rate;
+}
+
+static void
+known_schedule(struct meter_schedule *sched)
+{
+	memset(sched, '\0', sizeof(*sched));
+	/* Out of order, so the latest period is not simply the last. */
+	period(sched, 1, 0, 22, 0, 3);
+	period(sched, 1, 1, 7, 0, 2);
+	period(sched, 2, 0, 6, 30, 1);
+	period(sched, 2, 1, 18, 0, 4);
+	period(sched, 3, 0, 0, 0, 2);
+	period(sched, 4, 0, 12, 0, 3);
+	sched->season[0].month = 3;
+	sched->season[0].day = 1;
+	sched->season[0].schedule = 1;
+	sched->season[1].month = 11;
+	sched->season[1].day = 1;
+	sched->season[1].schedule = 2;
+	sched->holiday[0].month = 7;
+	sched->holiday[0].day = 4;
+	sched->holiday[1].month = 12;
+	sched->holiday[1].day = 25;
+	sched->weekend_schedule = 3;
+	sched->holiday_schedule = 4;
+}
+
+/*
+ * Not a schedule a meter could have, but any mistake in the local time
+ * shows up as a different value.
+ */
+static void
+scrambled_tariff(struct meter_tariff *tariff)
+{
+	int	 s, minute, mon, mday;
+
+	for (s = 0; s < EKM_SCHEDULES; s++)
+		for (minute = 0; minute < 24 * 60; minute++)
+			tariff->rate[s][minute] = minute * 7 + s * 31;
+	for (mon = 0; mon < 12; mon++)
+		for (mday = 0; mday < 31; mday++) {
+			tariff->day[mon][mday][0] = (mon * 31 + mday) % 4;
+			tariff->day[mon][mday][1] = 4 + (mon * 31 + mday) % 4;
+		}
+	tariff->cache_start = tariff->cache_end = 0;
+}
+
+static int
+result(const char *name, int bad)
+{
+	printf("%-34s %s\n", name, bad ? "FAILED" : "ok");
+	return(bad != 0);
+}
+
+static int
+check_cases(struct meter_tariff *tariff)
+{
+	const struct rate_case	*c;
+	int			 got, failed;
+
+	failed = 0;
+	for (c = cases; c < cases + sizeof(cases) / sizeof(cases[0]); c++) {
+		got = meter_tariff_rate(tariff, c->mon, c->mday, c->wday,
+		    c->hour, c->min);
+		if (got != c->rate)
+			printf("%02d-%02d %02d:%02d: rate %d, want %d\n",
+			    c->mon + 1, c->mday, c->hour, c->min, got, c->rate);
+		failed |= result(c->name, got != c->rate);
+	}
+	return(failed);
+}
+
+static int
+check_empty(struct meter_tariff *tariff)
+{
+	struct meter_schedule	 sched;
+	int			 mon, mday, wday, minute, bad;
+
+	memset(&sched, '\0', sizeof(sched));
+	meter_tariff_init(tariff, &sched);
+	for (bad = 0, mon = 0; mon < 12; mon++)
+		for (mday = 1; mday <= 31; mday++)
+			for (wday = 0; wday < 7; wday++)
+				for (minute = 0; minute < 24 * 60; minute += 7)
+					bad += meter_tariff_rate(tariff, mon,
+					    mday, wday, minute / 60,
+					    minute % 60) != 1;
+	return(result("empty schedule is rate 1", bad));
+}
+
+static int
+libc_rate(struct meter_tariff *tariff, time_t t)
+{
+	struct tm	 tm;
+
+	localtime_r(&t, &tm);
+	return(meter_tariff_rate(tariff, tm.tm_mon, tm.tm_mday, tm.tm_wday,
+	    tm.tm_hour, tm.tm_min));
+}
+
+/*
+ * Walk forward in steps of up to two hours, as readings in time order
+ * would, with the odd jump back to exercise the cache.
+ */
+static time_t
+next_time(time_t t)
+{
+	switch (rand() % 100) {
+	    case 0:
+		return(t - rand() % (30 * 86400));
+	    case 1:
+		return(t - rand() % 3600);
+	    default:
+		return(t + rand() % 7200);
+	}
+}
+
+static long
+compare(struct meter_tariff *tariff, const char *zone, time_t t, long bad)
+{
+	int	 got, want;
+
+	if ((got = meter_tariff_rate_time(tariff, t)) !=
+	    (want = libc_rate(tariff, t)) && bad < 5)
+		printf("%s %lld: rate %d, localtime_r %d\n", zone,
+		    (long long)t, got, want);
+	return(got != want);
+}
+
+/*
+ * Cross each offset change a minute at a time from either side, starting
+ * with nothing cached.
+ */
+static long
+check_changes(struct meter_tariff *tariff, const char *zone)
+{
+	struct tm	 tm;
+	time_t		 t, u;
+	long		 bad, off;
+
+	localtime_r(&(time_t){ 1577836800 }, &tm);
+	for (bad = 0, off = tm.tm_gmtoff, t = 1577836800; t < 1893456000;
+	    t += 1800) {
+		localtime_r(&t, &tm);
+		if (tm.tm_gmtoff == off)
+			continue;
+		off = tm.tm_gmtoff;
+		tariff->cache_start = tariff->cache_end = 0;
+		for (u = t - 3 * 3600; u < t + 3 * 3600; u += 60)
+			bad += compare(tariff, zone, u, bad);
+		tariff->cache_start = tariff->cache_end = 0;
+		for (u = t + 3 * 3600; u > t - 3 * 3600; u -= 60)
+			bad += compare(tariff, zone, u, bad);
+	}
+	return(bad);
+}
+
+static double
+bench(struct meter_tariff *tariff, int (*rate)(struct meter_tariff *, time_t))
+{
+	struct timespec	 t0, t1;
+	volatile int	 sink;
+	time_t		 t;
+	int		 i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (sink = 0, t = 1600000000, i = 0; i < TIMES; i++, t += 10)
+		sink += rate(tariff, t);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return(((t1.tv_sec - t0.tv_sec) * 1e9 + t1.tv_nsec - t0.tv_nsec) /
+	    TIMES);
+}
+
+static int
+check_zone(struct meter_tariff *tariff, const char *zone, int bflag)
+{
+	char	 name[64];
+	time_t	 t;
+	long	 bad;
+	int	 i;
+
+	setenv("TZ", zone, 1);
+	tzset();
+	tariff->cache_start = tariff->cache_end = 0;
+	srand(1);
+	for (bad = 0, t = 1577836800, i = 0; i < TIMES; i++, t = next_time(t))
+		bad += compare(tariff, zone, t, bad);
+	bad += check_changes(tariff, zone);
+	snprintf(name, sizeof(name), "time in %s", zone);
+	result(name, bad);
+	if (bflag)
+		printf("%-34s cached %.1f ns, localtime_r %.1f ns\n", "",
+		    bench(tariff, meter_tariff_rate_time),
+		    bench(tariff, libc_rate));
+	return(bad != 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct meter_schedule	 sched;
+	struct meter_tariff	*tariff;
+	const char * const	*zone;
+	int			 ch, bflag, failed;
+
+	bflag = 0;
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		    case 'b':
+			bflag = 1;
+			break;
+		    default:
+			fprintf(stderr, "usage: tariffcheck [-b]\n");
+			return(2);
+		}
+	}
+	if ((tariff = malloc(sizeof(*tariff))) == NULL) {
+		perror("tariffcheck");
+		return(2);
+	}
+
+	known_schedule(&sched);
+	meter_tariff_init(tariff, &sched);
+	failed = check_cases(tariff);
+	scrambled_tariff(tariff);
+	for (zone = zones; *zone != NULL; zone++)
+		failed |= check_zone(tariff, *zone, bflag);
+	failed |= check_empty(tariff);
+
+	return(failed);
+}
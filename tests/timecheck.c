@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * Check ekm_time() against the strptime() and mktime() conversion it
+ * replaced.
+ *
+ *	timecheck [-b] [zone ...]
+ *
+ * Random meter dates, half of them in the months where time zones
+ * usually change offset, are converted in each zone.  Any difference is
+ * reported and makes the exit status 1, as does a malformed date that
+ * does not convert to -1.  -b also times both conversions.
+ * ekm_time() caches offsets for the life of the process, so each zone is
+ * checked in a child of its own.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ekm.h"
+
+#define	DATES		200000
+#define	BENCH_CALLS	2000000
+
+static const char * const malformed[] = {
+	"  0101010000000", "-10101010000000", "9a0101010000000",
+	"000101010000 0"
+};
+
+static const char * const zones[] = {
+	"UTC", "America/New_York", "America/St_Johns", "America/Santiago",
+	"America/Sao_Paulo", "Europe/London", "Europe/Dublin",
+	"Europe/Moscow", "Africa/Casablanca", "Asia/Tehran", "Asia/Kolkata",
+	"Australia/Lord_Howe", "Pacific/Chatham", "Pacific/Apia",
+	"Antarctica/Troll", NULL
+};
+
+static time_t
+libc_time(const char *date)
+{
+	struct tm	 tm;
+	char		 buf[16];
+
+	/* Leave out the weekday, which mktime() works out. */
+	memcpy(buf, date, 6);
+	memcpy(buf + 6, date + 8, 6);
+	buf[12] = '\0';
+	memset(&tm, '\0', sizeof(tm));
+	strptime(buf, "%y%m%d%H%M%S", &tm);
+	return(mktime(&tm));
+}
+
+static void
+random_date(char *date, int i)
+{
+	static const int	 change[] = { 3, 4, 9, 10, 11 };
+	int			 mon;
+
+	mon = i % 2 ? change[rand() % 5] : 1 + rand() % 12;
+	snprintf(date, 32, "%02d%02d%02d%02d%02d%02d%02d", rand() % 100, mon,
+	    1 + rand() % 28, 1 + rand() % 7, rand() % 24, rand() % 60,
+	    rand() % 60);
+}
+
+static double
+bench(time_t (*conv)(const char *), char *date)
+{
+	struct timespec	 t0, t1;
+	volatile time_t	 sink;
+	int		 i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (sink = 0, i = 0; i < BENCH_CALLS; i++) {
+		date[1] = '0' + i % 10;
+		sink += conv(date);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return(((t1.tv_sec - t0.tv_sec) * 1e9 + t1.tv_nsec - t0.tv_nsec) /
+	    BENCH_CALLS);
+}
+
+static int
+check(const char *zone, int bflag)
+{
+	char	 date[32];
+	time_t	 got, want;
+	long	 bad;
+	int	 i;
+
+	setenv("TZ", zone, 1);
+	tzset();
+	srand(1);
+	for (bad = 0, i = 0; i < DATES; i++) {
+		random_date(date, i);
+		if ((got = ekm_time(date)) == (want = libc_time(date)))
+			continue;
+		if (bad++ < 5)
+			printf("%s %s: ekm_time %lld, mktime %lld\n", zone,
+			    date, (long long)got, (long long)want);
+	}
+	for (i = 0; i < (int)(sizeof(malformed) / sizeof(malformed[0])); i++)
+		if ((got = ekm_time(malformed[i])) != -1 && bad++ < 5)
+			printf("%s \"%s\": ekm_time %lld, want -1\n", zone,
+			    malformed[i], (long long)got);
+	printf("%-20s %ld/%d mismatches\n", zone, bad, DATES);
+	if (bflag)
+		printf("%-20s ekm_time %.1f ns, strptime+mktime %.1f ns\n",
+		    "", bench(ekm_time, date), bench(libc_time, date));
+
+	return(bad != 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char * const	*zone;
+	pid_t			 pid;
+	int			 ch, bflag, failed, status;
+
+	bflag = 0;
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		    case 'b':
+			bflag = 1;
+			break;
+		    default:
+			fprintf(stderr, "usage: timecheck [-b] [zone ...]\n");
+			exit(2);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	zone = argc > 0 ? (const char * const *)argv : zones;
+
+	for (failed = 0; *zone != NULL; zone++) {
+		fflush(stdout);
+		if ((pid = fork()) == -1) {
+			perror("fork");
+			exit(2);
+		}
+		if (pid == 0)
+			exit(check(*zone, bflag));
+		if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+
+	return(failed);
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2012-2021 Ian Freislich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * Crash recovery checks and a benchmark for the write-ahead log.
+ *
+ *	walcheck [-b]
+ *
+ * Each case runs the WAL in a child that exits without committing, as a
+ * crash would, then recovers in a second child and compares the reading
+ * log with what should have survived.  The WAL keeps its state in
+ * statics, so every run needs a process of its own.  -b instead reports
+ * readings per second for a range of commit intervals.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ekm.h"
+#include "../ekmd.h"
+
+/* Offset of the first record and size of a record header in ekmwal.c. */
+#define	WAL_DATA	128
+#define	WAL_RECHDR	24
+
+#define	BENCH_READINGS	2000
+
+static char	 walpath[1024], logpath[1024], oldpath[1024];
+
+static int
+wal_start(void)
+{
+	int	 fd;
+
+	if (wal_open(walpath) == -1 ||
+	    (fd = open(logpath, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1)
+		exit(2);
+	wal_setlog(fd);
+	return(fd);
+}
+
+/*
+ * Run fn in a child, as a separate lifetime of the daemon.
+ */
+static void
+run(void (*fn)(void))
+{
+	pid_t	 pid;
+	int	 status;
+
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		exit(2);
+	}
+	if (pid == 0) {
+		wal_interval = 60000;
+		fn();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "walcheck: child failed\n");
+		exit(2);
+	}
+}
+
+static void
+recover(void)
+{
+	wal_start();
+}
+
+static void
+append_abc(void)
+{
+	wal_start();
+	wal_append("a1\n", 3);
+	wal_append("b22\n", 4);
+	wal_append("c333\n", 5);
+}
+
+static void
+commit_then_crash(void)
+{
+	int	 fd;
+
+	fd = wal_start();
+	wal_append("a1\n", 3);
+	wal_append("b22\n", 4);
+	wal_commit();
+	/* Part of a later group reached the log, the WAL record didn't. */
+	write(fd, "junk\n", 5);
+	wal_append("c333\n", 5);
+}
+
+static void
+rotate(void)
+{
+	int	 fd;
+
+	fd = wal_start();
+	wal_append("a1\n", 3);
+	wal_append("b22\n", 4);
+	rename(logpath, oldpath);
+	wal_setlog(open(logpath, O_WRONLY | O_APPEND | O_CREAT, 0666));
+	close(fd);
+}
+
+/*
+ * Recover into a log that can't be written.
+ */
+static void
+recover_readonly(void)
+{
+	int	 fd;
+
+	if (wal_open(walpath) == -1 || (fd = open(logpath, O_RDONLY)) == -1)
+		exit(2);
+	wal_setlog(fd);
+}
+
+/*
+ * Keep reading while recovery fails, then recover into a writable log.
+ */
+static void
+recover_later(void)
+{
+	int	 fd;
+
+	if (wal_open(walpath) == -1 || (fd = open(logpath, O_RDONLY)) == -1)
+		exit(2);
+	wal_setlog(fd);
+	wal_append("d4444\n", 6);
+	wal_commit();
+	wal_setlog(open(logpath, O_WRONLY | O_APPEND | O_CREAT, 0666));
+	close(fd);
+	wal_append("e55555\n", 7);
+	wal_commit();
+}
+
+static void
+wal_cut(off_t len)
+{
+	struct stat	 sb;
+
+	if (stat(walpath, &sb) == -1 || truncate(walpath, sb.st_size - len))
+		exit(2);
+}
+
+static void
+wal_flip(off_t off)
+{
+	char	 c;
+	int	 fd;
+
+	if ((fd = open(walpath, O_RDWR)) == -1 ||
+	    pread(fd, &c, 1, off) != 1)
+		exit(2);
+	c ^= 0x20;
+	pwrite(fd, &c, 1, off);
+	close(fd);
+}
+
+static int
+expect(const char *name, const char *path, const char *want)
+{
+	char	 buf[256];
+	ssize_t	 n;
+	int	 fd;
+
+	n = 0;
+	if ((fd = open(path, O_RDONLY)) != -1) {
+		if ((n = read(fd, buf, sizeof(buf) - 1)) < 0)
+			n = 0;
+		close(fd);
+	}
+	buf[n] = '\0';
+	if (strcmp(buf, want) == 0) {
+		printf("%-34s ok\n", name);
+		return(0);
+	}
+	printf("%-34s FAILED\n  want \"%s\"\n  got  \"%s\"\n", name, want,
+	    buf);
+	return(1);
+}
+
+static void
+reset(void)
+{
+	unlink(walpath);
+	unlink(logpath);
+	unlink(oldpath);
+}
+
+static int
+check(void)
+{
+	int	 failed;
+
+	failed = 0;
+
+	reset();
+	run(append_abc);
+	run(recover);
+	failed |= expect("uncommitted records replayed", logpath,
+	    "a1\nb22\nc333\n");
+	run(recover);
+	failed |= expect("second recovery adds nothing", logpath,
+	    "a1\nb22\nc333\n");
+
+	reset();
+	run(commit_then_crash);
+	run(recover);
+	failed |= expect("log cut back to checkpoint", logpath,
+	    "a1\nb22\nc333\n");
+
+	reset();
+	run(append_abc);
+	wal_cut(2);
+	run(recover);
+	failed |= expect("torn tail discarded", logpath, "a1\nb22\n");
+
+	reset();
+	run(append_abc);
+	wal_flip(WAL_DATA + 2 * WAL_RECHDR + 3);
+	run(recover);
+	failed |= expect("replay stops at a bad record", logpath, "a1\n");
+
+	reset();
+	run(append_abc);
+	run(recover_readonly);
+	failed |= expect("failed replay leaves the log", logpath, "");
+	run(recover);
+	failed |= expect("failed replay recovered later", logpath,
+	    "a1\nb22\nc333\n");
+
+	reset();
+	run(append_abc);
+	run(recover_later);
+	failed |= expect("readings wait for recovery", logpath,
+	    "a1\nb22\nc333\nd4444\ne55555\n");
+	run(recover);
+	failed |= expect("recovered once", logpath,
+	    "a1\nb22\nc333\nd4444\ne55555\n");
+
+	reset();
+	run(rotate);
+	run(recover);
+	failed |= expect("pending records survive rotation", logpath,
+	    "a1\nb22\n");
+	failed |= expect("rotated log left alone", oldpath, "");
+
+	reset();
+	return(failed);
+}
+
+static long	 bench_interval;
+
+static void
+bench_run(void)
+{
+	struct timespec	 t0, t1;
+	char		 reading[400];
+	double		 secs;
+	int		 i, len;
+
+	wal_interval = bench_interval;
+	wal_start();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_READINGS; i++) {
+		len = snprintf(reading, sizeof(reading), "reading %d %0300d\n",
+		    i, 0);
+		wal_append(reading, len);
+	}
+	wal_commit();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("commit interval %5ld ms: %8.0f readings/s\n", bench_interval,
+	    BENCH_READINGS / secs);
+}
+
+static void
+bench(void)
+{
+	static const long	 intervals[] = { 0, 10, 100, 1000, 5000 };
+	int			 i;
+
+	for (i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+		reset();
+		bench_interval = intervals[i];
+		run(bench_run);
+	}
+	reset();
+}
+
+int
+main(int argc, char **argv)
+{
+	char	 dir[] = "/tmp/walcheck.XXXXXX";
+	int	 failed;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(2);
+	}
+	snprintf(walpath, sizeof(walpath), "%s/ekm.wal", dir);
+	snprintf(logpath, sizeof(logpath), "%s/log", dir);
+	snprintf(oldpath, sizeof(oldpath), "%s/log.old", dir);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	failed = 0;
+	if (argc > 1 && strcmp(argv[1], "-b") == 0)
+		bench();
+	else
+		failed = check();
+	rmdir(dir);
+
+	return(failed);
+}